@@ -0,0 +1,132 @@
+/*
+
+ACCOUNTING MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "accounting.h"
+
+typedef struct {
+    unsigned long on_time;      // Accumulated ON time in seconds, the running period not included
+    unsigned long switches;     // Number of physical switches
+    unsigned long on_since;     // millis() of the last switch ON
+} accounting_t;
+
+accounting_t _accounting[RELAY_MAX];
+
+// Physical state as seen by the counters, relays are OFF at power on
+unsigned char _accountingOn[RELAY_BYTES];
+unsigned char _accountingDirty[RELAY_BYTES];
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void _accountingPack(unsigned long value, unsigned char * out) {
+    for (unsigned char i = 4; i > 0; i--) {
+        out[i - 1] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+unsigned long _accountingUnpack(const unsigned char * in) {
+    unsigned long value = 0;
+    for (unsigned char i = 0; i < 4; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void _accountingLoad(unsigned char id) {
+    unsigned char record[ACCOUNTING_RECORD_SIZE];
+    if (hexDecode(getSetting(K_ACCOUNTING, id, "").c_str(), record, ACCOUNTING_RECORD_SIZE) != ACCOUNTING_RECORD_SIZE) return;
+    _accounting[id].on_time = _accountingUnpack(record);
+    _accounting[id].switches = _accountingUnpack(record + 4);
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Called by the relay provider on every physical change, constant time
+ * Changes to the state the counters already know about (boot) are ignored
+ */
+void accountingSwitch(unsigned char id, bool status) {
+    if (id >= RELAY_MAX) return;
+
+    unsigned char bit = 1 << (id & 7);
+    if (((_accountingOn[id >> 3] & bit) != 0) == status) return;
+
+    unsigned long now = millis();
+    if (status) {
+        _accountingOn[id >> 3] |= bit;
+        _accounting[id].on_since = now;
+    } else {
+        _accountingOn[id >> 3] &= ~bit;
+        // Rounded, so short pulses are not always lost
+        _accounting[id].on_time += (now - _accounting[id].on_since + 500) / 1000;
+    }
+
+    _accounting[id].switches++;
+    _accountingDirty[id >> 3] |= bit;
+}
+
+unsigned long accountingOnTime(unsigned char id) {
+    if (id >= RELAY_MAX) return 0;
+    unsigned long on_time = _accounting[id].on_time;
+    if (_accountingOn[id >> 3] & (1 << (id & 7))) {
+        on_time += (millis() - _accounting[id].on_since) / 1000;
+    }
+    return on_time;
+}
+
+unsigned long accountingSwitches(unsigned char id) {
+    if (id >= RELAY_MAX) return 0;
+    return _accounting[id].switches;
+}
+
+/**
+ * Packs the counters of the relay into ACCOUNTING_RECORD_SIZE bytes
+ */
+void accountingRecord(unsigned char id, unsigned char * record) {
+    _accountingPack(accountingOnTime(id), record);
+    _accountingPack(accountingSwitches(id), record + 4);
+}
+
+/**
+ * Writes the relays that switched since the last save and the ones still ON
+ */
+void accountingSave() {
+    unsigned char record[ACCOUNTING_RECORD_SIZE];
+    char buffer[2 * ACCOUNTING_RECORD_SIZE + 1];
+
+    for (unsigned char i = 0; i < RELAY_BYTES; i++) {
+        unsigned char dirty = _accountingDirty[i] | _accountingOn[i];
+        if (dirty == 0) continue;
+        _accountingDirty[i] = 0;
+
+        for (unsigned char j = 0; j < 8; j++) {
+            if ((dirty & (1 << j)) == 0) continue;
+            unsigned char id = 8 * i + j;
+            accountingRecord(id, record);
+            hexEncode(record, ACCOUNTING_RECORD_SIZE, buffer);
+            setSetting(K_ACCOUNTING, id, buffer);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void accountingSetup() {
+    unsigned char count = getSetting(K_NO_OF_RELAYS, 1).toInt();
+    for (unsigned char id = 0; id < count && id < RELAY_MAX; id++) {
+        _accountingLoad(id);
+    }
+
+    taskRegister(accountingSave, ACCOUNTING_SAVE_INTERVAL, TASK_PRIORITY_LOW);
+}
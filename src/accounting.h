@@ -0,0 +1,38 @@
+/*
+
+ACCOUNTING HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "debug.h"
+#include "utils.h"
+#include "task.h"
+#include "relay.h"
+
+// Counters are written to EEPROM at most once per this many ms, and only
+// for the relays that switched since the last write or are ON, as their
+// on time keeps growing (a year of hourly writes is below 10% of the
+// EEPROM endurance)
+#ifndef ACCOUNTING_SAVE_INTERVAL
+#define ACCOUNTING_SAVE_INTERVAL    3600000UL
+#endif
+
+// Bytes per relay in the stored and reported record:
+// on time in seconds and number of switches, both 4 bytes big endian
+#define ACCOUNTING_RECORD_SIZE      8
+
+void accountingSwitch(unsigned char id, bool status);
+unsigned long accountingOnTime(unsigned char id);
+unsigned long accountingSwitches(unsigned char id);
+void accountingRecord(unsigned char id, unsigned char * record);
+void accountingSave();
+void accountingSetup();
+
+#endif
@@ -0,0 +1,107 @@
+/*
+
+CHANNEL MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "channel.h"
+
+typedef struct {
+    Print * port;               // NULL until attached
+    char * buffer;
+    unsigned char size;
+    unsigned char head;         // Next byte to write
+    unsigned char tail;         // Next byte to send
+} channel_t;
+
+char _channelDebugBuffer[CHANNEL_DEBUG_BUFFER];
+char _channelBridgeBuffer[CHANNEL_BRIDGE_BUFFER];
+char _channelDiagBuffer[CHANNEL_DIAG_BUFFER];
+
+channel_t _channels[CHANNEL_MAX] = {
+    { NULL, _channelDebugBuffer, CHANNEL_DEBUG_BUFFER, 0, 0 },
+    { NULL, _channelBridgeBuffer, CHANNEL_BRIDGE_BUFFER, 0, 0 },
+    { NULL, _channelDiagBuffer, CHANNEL_DIAG_BUFFER, 0, 0 }
+};
+
+unsigned char _channelNext = 0;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void _channelService(channel_t & channel) {
+    if (channel.port == NULL) return;
+
+    // Only what the serial TX buffer can take right now
+    int room = channel.port->availableForWrite();
+    while (room > 0 && channel.tail != channel.head) {
+        channel.port->write(channel.buffer[channel.tail]);
+        if (++channel.tail == channel.size) channel.tail = 0;
+        room--;
+    }
+}
+
+/**
+ * Each pass starts with the next channel, so none of them always goes last
+ */
+void _channelLoop() {
+    for (unsigned char i = 0; i < CHANNEL_MAX; i++) {
+        _channelService(_channels[(_channelNext + i) % CHANNEL_MAX]);
+    }
+    if (++_channelNext == CHANNEL_MAX) _channelNext = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+void channelAttach(unsigned char id, Print * port) {
+    if (id >= CHANNEL_MAX) return;
+    _channels[id].port = port;
+}
+
+unsigned char channelFree(unsigned char id) {
+    if (id >= CHANNEL_MAX) return 0;
+    channel_t & channel = _channels[id];
+    if (channel.head >= channel.tail) {
+        return channel.size - 1 - (channel.head - channel.tail);
+    }
+    return channel.tail - channel.head - 1;
+}
+
+/**
+ * Queues the whole block or nothing
+ */
+bool channelWrite(unsigned char id, const char * data, unsigned char length) {
+    if (id >= CHANNEL_MAX) return false;
+    channel_t & channel = _channels[id];
+    if (channel.port == NULL) return false;
+    if (length > channelFree(id)) return false;
+
+    for (unsigned char i = 0; i < length; i++) {
+        channel.buffer[channel.head] = data[i];
+        if (++channel.head == channel.size) channel.head = 0;
+    }
+    return true;
+}
+
+/**
+ * Waits until everything queued is in the port
+ */
+void channelFlush(unsigned char id) {
+    if (id >= CHANNEL_MAX) return;
+    channel_t & channel = _channels[id];
+    if (channel.port == NULL) return;
+    while (channel.tail != channel.head) _channelService(channel);
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void channelSetup() {
+    espurnaRegisterLoop(_channelLoop);
+}
@@ -0,0 +1,41 @@
+/*
+
+CHANNEL HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <Arduino.h>
+#include "prototypes.h"
+
+// Output streams, each one with its own ring buffer, drained round-robin from the loop
+// Only what the port can take right away is written, so no channel waits behind another
+#define CHANNEL_DEBUG               0           // Log messages (DEBUG_PORT)
+#define CHANNEL_BRIDGE              1           // Frames to the bridge (UART_HW_PORT)
+#define CHANNEL_DIAG                2           // Telemetry (DIAG_PORT)
+#define CHANNEL_MAX                 3
+
+// Ring buffer sizes (max 255)
+#ifndef CHANNEL_DEBUG_BUFFER
+#define CHANNEL_DEBUG_BUFFER        128
+#endif
+
+#ifndef CHANNEL_BRIDGE_BUFFER
+#define CHANNEL_BRIDGE_BUFFER       128
+#endif
+
+#ifndef CHANNEL_DIAG_BUFFER
+#define CHANNEL_DIAG_BUFFER         128
+#endif
+
+void channelAttach(unsigned char id, Print * port);
+unsigned char channelFree(unsigned char id);
+bool channelWrite(unsigned char id, const char * data, unsigned char length);
+void channelFlush(unsigned char id);
+void channelSetup();
+
+#endif
@@ -0,0 +1,334 @@
+/*
+
+CONFIG MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "config.h"
+
+#define CONFIG_STATE_IDLE           0           // Waiting for the document
+#define CONFIG_STATE_VALUE          1           // Expecting a value
+#define CONFIG_STATE_KEY            2           // Expecting a key or the end of the object
+#define CONFIG_STATE_STRING         3
+#define CONFIG_STATE_COLON          4
+#define CONFIG_STATE_NUMBER         5
+#define CONFIG_STATE_LITERAL        6           // true, false or null
+#define CONFIG_STATE_NEXT           7           // Expecting a separator or the end of the container
+#define CONFIG_STATE_DONE           8
+#define CONFIG_STATE_ERROR          9
+
+#define CONFIG_FIELD_NONE           0
+#define CONFIG_FIELD_RELAYS         1
+#define CONFIG_FIELD_PIN            2
+#define CONFIG_FIELD_TYPE           3
+#define CONFIG_FIELD_BOOT           4
+
+#define CONFIG_KEY_SIZE             8           // Longer keys are unknown anyway
+#define CONFIG_NUMBER_MAX           255         // Every field is a byte
+
+typedef struct {
+    unsigned char pin;
+    unsigned char type;
+    unsigned char boot;
+    unsigned char fields;       // Bit per CONFIG_FIELD_* present
+} config_relay_t;
+
+unsigned char _configState = CONFIG_STATE_IDLE;
+unsigned long _configLast = 0;
+
+// Container and key of every open level, nothing else of the document is kept
+char _configStack[CONFIG_DEPTH_MAX];
+unsigned char _configFields[CONFIG_DEPTH_MAX];
+unsigned char _configDepth = 0;
+
+// Token being read
+char _configKey[CONFIG_KEY_SIZE];
+unsigned char _configKeyLength = 0;
+bool _configInKey = false;
+bool _configEscape = false;
+unsigned long _configNumber = 0;
+bool _configNumeric = false;
+
+// Relays parsed so far, nothing is written until the document is complete
+config_relay_t _configRelay[RELAY_MAX];
+unsigned char _configRelayCount = 0;
+bool _configRelays = false;     // The document had a relays array
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void _configReset() {
+    _configState = CONFIG_STATE_IDLE;
+    _configDepth = 0;
+    _configRelayCount = 0;
+    _configRelays = false;
+}
+
+unsigned char _configField(const char * key) {
+    if (strcmp_P(key, PSTR("relays")) == 0) return CONFIG_FIELD_RELAYS;
+    if (strcmp_P(key, PSTR("pin")) == 0) return CONFIG_FIELD_PIN;
+    if (strcmp_P(key, PSTR("type")) == 0) return CONFIG_FIELD_TYPE;
+    if (strcmp_P(key, PSTR("boot")) == 0) return CONFIG_FIELD_BOOT;
+    return CONFIG_FIELD_NONE;
+}
+
+// {"relays":[{ ... }]}, an object inside the relays array
+bool _configInRelay() {
+    return (_configDepth == 3)
+        && (_configFields[0] == CONFIG_FIELD_RELAYS)
+        && (_configStack[1] == '[')
+        && (_configStack[2] == '{');
+}
+
+void _configValue() {
+    if (!_configInRelay() || !_configNumeric) return;
+
+    unsigned char field = _configFields[2];
+    if (field == CONFIG_FIELD_NONE) return;
+
+    // Out of range, truncating it would write some other pin
+    if (_configNumber > CONFIG_NUMBER_MAX) {
+        _configState = CONFIG_STATE_ERROR;
+        return;
+    }
+
+    // Relays past RELAY_MAX are parsed and dropped
+    if (_configRelayCount == RELAY_MAX) return;
+
+    config_relay_t & relay = _configRelay[_configRelayCount];
+    unsigned char value = _configNumber;
+    if (field == CONFIG_FIELD_PIN) relay.pin = value;
+    if (field == CONFIG_FIELD_TYPE) relay.type = value;
+    if (field == CONFIG_FIELD_BOOT) relay.boot = value;
+    relay.fields |= (1 << field);
+}
+
+void _configOpen(char c) {
+    if (_configDepth == CONFIG_DEPTH_MAX) {
+        _configState = CONFIG_STATE_ERROR;
+        return;
+    }
+    _configStack[_configDepth] = c;
+    _configFields[_configDepth] = CONFIG_FIELD_NONE;
+    _configDepth++;
+
+    if (_configInRelay() && (_configRelayCount < RELAY_MAX)) _configRelay[_configRelayCount].fields = 0;
+
+    _configState = (c == '{') ? CONFIG_STATE_KEY : CONFIG_STATE_VALUE;
+}
+
+void _configClose(char c) {
+    if (_configDepth == 0 || _configStack[_configDepth - 1] != (c == '}' ? '{' : '[')) {
+        _configState = CONFIG_STATE_ERROR;
+        return;
+    }
+
+    if (_configInRelay() && (_configRelayCount < RELAY_MAX)) _configRelayCount++;
+
+    if (_configDepth == 2 && _configFields[0] == CONFIG_FIELD_RELAYS && _configStack[1] == '[') _configRelays = true;
+
+    _configDepth--;
+    _configState = (_configDepth == 0) ? CONFIG_STATE_DONE : CONFIG_STATE_NEXT;
+}
+
+void _configFeed(char c) {
+
+    switch (_configState) {
+
+        case CONFIG_STATE_IDLE:
+            if (c == '{') {
+                _configOpen(c);
+            } else if (!isspace(c)) {
+                _configState = CONFIG_STATE_ERROR;
+            }
+            break;
+
+        case CONFIG_STATE_VALUE:
+            if (isspace(c)) break;
+            _configNumeric = false;
+            if (c == '{' || c == '[') {
+                _configOpen(c);
+            } else if (c == ']') {
+                _configClose(c);
+            } else if (c == '"') {
+                _configInKey = false;
+                _configEscape = false;
+                _configState = CONFIG_STATE_STRING;
+            } else if (isdigit(c)) {
+                _configNumber = c - '0';
+                _configNumeric = true;
+                _configState = CONFIG_STATE_NUMBER;
+            } else if (c == '-' || isalpha(c)) {
+                // Negative numbers and literals are not part of the schema
+                _configState = CONFIG_STATE_LITERAL;
+            } else {
+                _configState = CONFIG_STATE_ERROR;
+            }
+            break;
+
+        case CONFIG_STATE_KEY:
+            if (isspace(c)) break;
+            if (c == '"') {
+                _configKeyLength = 0;
+                _configInKey = true;
+                _configEscape = false;
+                _configState = CONFIG_STATE_STRING;
+            } else if (c == '}') {
+                _configClose(c);
+            } else {
+                _configState = CONFIG_STATE_ERROR;
+            }
+            break;
+
+        case CONFIG_STATE_STRING:
+            if (_configEscape) {
+                _configEscape = false;
+            } else if (c == '\\') {
+                _configEscape = true;
+                break;
+            } else if (c == '"') {
+                if (_configInKey) {
+                    _configKey[_configKeyLength < CONFIG_KEY_SIZE ? _configKeyLength : 0] = '\0';
+                    _configState = CONFIG_STATE_COLON;
+                } else {
+                    _configState = CONFIG_STATE_NEXT;
+                    _configValue();
+                }
+                break;
+            }
+            if (_configInKey) {
+                // Too long, never matches a field
+                if (_configKeyLength < CONFIG_KEY_SIZE - 1) _configKey[_configKeyLength] = c;
+                if (_configKeyLength < CONFIG_KEY_SIZE) _configKeyLength++;
+            }
+            break;
+
+        case CONFIG_STATE_COLON:
+            if (isspace(c)) break;
+            if (c == ':') {
+                _configFields[_configDepth - 1] = _configField(_configKey);
+                _configState = CONFIG_STATE_VALUE;
+            } else {
+                _configState = CONFIG_STATE_ERROR;
+            }
+            break;
+
+        case CONFIG_STATE_NUMBER:
+            if (isdigit(c)) {
+                // Saturates, so a long run of digits cannot wrap into range
+                if (_configNumber <= CONFIG_NUMBER_MAX) _configNumber = 10 * _configNumber + (c - '0');
+                break;
+            }
+            // Before the value, which can still fail the document
+            _configState = CONFIG_STATE_NEXT;
+            _configValue();
+            _configFeed(c);
+            break;
+
+        case CONFIG_STATE_LITERAL:
+            if (isalnum(c) || c == '.' || c == '-' || c == '+') break;
+            _configState = CONFIG_STATE_NEXT;
+            _configFeed(c);
+            break;
+
+        case CONFIG_STATE_NEXT:
+            if (isspace(c)) break;
+            if (c == ',') {
+                _configState = (_configStack[_configDepth - 1] == '{') ? CONFIG_STATE_KEY : CONFIG_STATE_VALUE;
+            } else if (c == '}' || c == ']') {
+                _configClose(c);
+            } else {
+                _configState = CONFIG_STATE_ERROR;
+            }
+            break;
+
+        case CONFIG_STATE_DONE:
+            if (!isspace(c)) _configState = CONFIG_STATE_ERROR;
+            break;
+
+        default:
+            break;
+    }
+}
+
+void _configWriteString_P(void (*write)(char), PGM_P s) {
+    char c;
+    while ((c = pgm_read_byte(s++))) write(c);
+}
+
+void _configWriteNumber(void (*write)(char), unsigned char n) {
+    char digits[3];
+    unsigned char i = 0;
+    do {
+        digits[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (i > 0) write(digits[--i]);
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Feeds the next piece of the document, settings are only written once
+ * it is complete, a malformed document leaves them as they were
+ * The new configuration is used after a reboot
+ */
+char configImport(const char * chunk) {
+
+    // Start over after a finished, broken or abandoned document
+    if (_configState == CONFIG_STATE_DONE || _configState == CONFIG_STATE_ERROR
+        || (millis() - _configLast > CONFIG_IMPORT_TIMEOUT)) {
+        _configReset();
+    }
+    _configLast = millis();
+
+    while (*chunk && _configState != CONFIG_STATE_ERROR) {
+        _configFeed(*chunk++);
+    }
+
+    if (_configState == CONFIG_STATE_ERROR) {
+        DEBUG_LOG_P(DEBUG_MODULE_SETTINGS, DEBUG_LEVEL_WARNING, PSTR("[CONFIG] Malformed document\n"));
+        return CONFIG_IMPORT_ERROR;
+    }
+
+    if (_configState != CONFIG_STATE_DONE) return CONFIG_IMPORT_MORE;
+
+    unsigned char count = _configRelayCount;
+    for (unsigned char id = 0; id < count; id++) {
+        const config_relay_t & relay = _configRelay[id];
+        if (relay.fields & (1 << CONFIG_FIELD_PIN)) setSetting(K_RELAY_PIN, id, relay.pin);
+        if (relay.fields & (1 << CONFIG_FIELD_TYPE)) setSetting(K_RELAY_TYPE, id, relay.type);
+        if (relay.fields & (1 << CONFIG_FIELD_BOOT)) setSetting(K_RELAY_BOOT_MODE, id, relay.boot);
+    }
+
+    if (_configRelays) {
+        setSetting(K_NO_OF_RELAYS, count);
+        DEBUG_LOG_P(DEBUG_MODULE_SETTINGS, DEBUG_LEVEL_INFO, PSTR("[CONFIG] %d relays imported, reboot to apply\n"), count);
+    }
+    return CONFIG_IMPORT_DONE;
+}
+
+/**
+ * Writes the stored configuration one char at a time
+ */
+void configExport(void (*write)(char)) {
+    unsigned char count = getSetting(K_NO_OF_RELAYS, 1).toInt();
+
+    _configWriteString_P(write, PSTR("{\"relays\":["));
+    for (unsigned char id = 0; id < count; id++) {
+        if (id > 0) write(',');
+        _configWriteString_P(write, PSTR("{\"pin\":"));
+        _configWriteNumber(write, getSetting(K_RELAY_PIN, id, GPIO_NONE).toInt());
+        _configWriteString_P(write, PSTR(",\"type\":"));
+        _configWriteNumber(write, getSetting(K_RELAY_TYPE, id, RELAY_TYPE_INVERSE).toInt());
+        _configWriteString_P(write, PSTR(",\"boot\":"));
+        _configWriteNumber(write, getSetting(K_RELAY_BOOT_MODE, id, RELAY_BOOT_MODE).toInt());
+        write('}');
+    }
+    _configWriteString_P(write, PSTR("]}"));
+}
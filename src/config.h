@@ -0,0 +1,38 @@
+/*
+
+CONFIG HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "debug.h"
+#include "relay.h"
+
+// Relay configuration document, imported and exported as a stream:
+// {"relays":[{"pin":22,"type":1,"boot":0},...]}
+// Unknown keys are skipped, missing fields keep their stored value
+
+#define CONFIG_IMPORT_MORE          '+'         // Chunk consumed, document not finished
+#define CONFIG_IMPORT_DONE          '='         // Document complete, settings written
+#define CONFIG_IMPORT_ERROR         '!'         // Malformed document, parser reset and nothing written
+
+// Maximum nesting, the schema itself needs 3 levels
+#ifndef CONFIG_DEPTH_MAX
+#define CONFIG_DEPTH_MAX            4
+#endif
+
+// An unfinished import is dropped after these many ms without data
+#ifndef CONFIG_IMPORT_TIMEOUT
+#define CONFIG_IMPORT_TIMEOUT       5000
+#endif
+
+char configImport(const char * chunk);
+void configExport(void (*write)(char));
+
+#endif
@@ -7,53 +7,69 @@ Copyright (C) 2019 by Shaeed Khan
 */
 
 #include "debug.h"
-void _debugSendSerial(const char* data) {
-    DEBUG_PORT.print(data);
-}
+
+unsigned char _debugMask = DEBUG_MASK;
+
+// Messages are queued in the debug channel and drained from the loop without blocking
+unsigned int _debugDropped = 0;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
 
 void _debugSend(const char * message) {
-    //if(isMqttConnected()) {
-    //    mqttSend(MQTT_TOPIC_DEBUG, message);
-    //} else {
-        _debugSendSerial(message);
-    //}
+    // Drop whole messages instead of truncating them
+    if (!channelWrite(CHANNEL_DEBUG, message, strlen(message))) {
+        _debugDropped++;
+    }
+}
+
+void _debugLoop() {
+
+    // Report lost messages once there is room again
+    if (_debugDropped > 0 && channelFree(CHANNEL_DEBUG) >= 32) {
+        char buffer[32];
+        snprintf_P(buffer, sizeof(buffer), PSTR("[DEBUG] %u messages dropped\n"), _debugDropped);
+        _debugDropped = 0;
+        _debugSend(buffer);
+    }
 }
 
 // -----------------------------------------------------------------------------
 
 void debugSend(const char * format, ...) {
-    /*va_list args;
+    char buffer[DEBUG_LINE_SIZE];
+    va_list args;
     va_start(args, format);
-    char test[1];
-    int len = ets_vsnprintf(test, 1, format, args) + 1;
-    char * buffer = new char[len];
-    ets_vsnprintf(buffer, len, format, args);
+    vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
 
     _debugSend(buffer);
-
-    delete[] buffer;*/
 }
 
 void debugSend_P(PGM_P format_P, ...) {
-    /*char format[strlen_P(format_P)+1];
-    memcpy_P(format, format_P, sizeof(format));
-
+    char buffer[DEBUG_LINE_SIZE];
     va_list args;
     va_start(args, format_P);
-    char test[1];
-    int len = ets_vsnprintf(test, 1, format, args) + 1;
-    char * buffer = new char[len];
-    ets_vsnprintf(buffer, len, format, args);
+    vsnprintf_P(buffer, sizeof(buffer), format_P, args);
     va_end(args);
 
     _debugSend(buffer);
+}
+
+void debugSetMask(unsigned char mask) {
+    _debugMask = mask;
+}
 
-    delete[] buffer;*/
+unsigned char debugGetMask() {
+    return _debugMask;
 }
 
 // -----------------------------------------------------------------------------
 
 void debugSetup() {
-        DEBUG_PORT.begin(SERIAL_BAUDRATE);
+    DEBUG_PORT.begin(SERIAL_BAUDRATE);
+    channelAttach(CHANNEL_DEBUG, &DEBUG_PORT);
+
+    espurnaRegisterLoop(_debugLoop);
 }
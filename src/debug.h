@@ -12,9 +12,32 @@ Copyright (C) 2019 by Shaeed Khan
 #include <avr/pgmspace.h>
 #include <Arduino.h>
 #include "prototypes.h"
+#include "channel.h"
 
-#define DEBUG_MSG(...) debugSend(__VA_ARGS__)
-#define DEBUG_MSG_P(...) debugSend_P(__VA_ARGS__)
+#define DEBUG_LEVEL_NONE        0
+#define DEBUG_LEVEL_ERROR       1
+#define DEBUG_LEVEL_WARNING     2
+#define DEBUG_LEVEL_INFO        3
+#define DEBUG_LEVEL_VERBOSE     4
+
+#define DEBUG_MODULE_MAIN       0x01
+#define DEBUG_MODULE_SETTINGS   0x02
+#define DEBUG_MODULE_RELAY      0x04
+#define DEBUG_MODULE_UART       0x08
+#define DEBUG_MODULE_INPUT      0x10
+#define DEBUG_MODULE_SYSTEM     0x20
+#define DEBUG_MODULE_MEMORY     0x40
+#define DEBUG_MODULE_ALL        0xFF
+
+// Messages above this level are not compiled in at all
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL             DEBUG_LEVEL_INFO
+#endif
+
+// Modules enabled at boot, can be changed at runtime with debugSetMask()
+#ifndef DEBUG_MASK
+#define DEBUG_MASK              DEBUG_MODULE_ALL
+#endif
 
 #ifndef DEBUG_PORT
 #define DEBUG_PORT              Serial          // Default debugging port
@@ -24,8 +47,25 @@ Copyright (C) 2019 by Shaeed Khan
 #define SERIAL_BAUDRATE         115200          // Default baudrate
 #endif
 
+#ifndef DEBUG_LINE_SIZE
+#define DEBUG_LINE_SIZE         64              // Longer messages are truncated
+#endif
+
+extern unsigned char _debugMask;
+
+// The level check is resolved by the compiler, the module check is a single branch
+#define DEBUG_LOG(module, level, ...) \
+    do { if (((level) <= DEBUG_LEVEL) && (_debugMask & (module))) debugSend(__VA_ARGS__); } while (0)
+#define DEBUG_LOG_P(module, level, ...) \
+    do { if (((level) <= DEBUG_LEVEL) && (_debugMask & (module))) debugSend_P(__VA_ARGS__); } while (0)
+
+#define DEBUG_MSG(...) DEBUG_LOG(DEBUG_MODULE_MAIN, DEBUG_LEVEL_INFO, __VA_ARGS__)
+#define DEBUG_MSG_P(...) DEBUG_LOG_P(DEBUG_MODULE_MAIN, DEBUG_LEVEL_INFO, __VA_ARGS__)
+
 void debugSend(const char * format, ...);
 void debugSend_P(PGM_P format, ...);
+void debugSetMask(unsigned char mask);
+unsigned char debugGetMask();
 void debugSetup();
 
-#endif
\ No newline at end of file
+#endif
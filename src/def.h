@@ -27,4 +27,12 @@ Copyright (C) 2019 by Shaeed Khan
 #define LOOP_DELAY_TIME         1               // Delay for this millis in the main loop [0-250] (see https://github.com/xoseperez/espurna/issues/1541)
 #endif
 
+#ifndef LOOP_CALLBACKS_MAX
+#define LOOP_CALLBACKS_MAX      8               // Maximum number of registered loop callbacks
+#endif
+
+#ifndef RELOAD_CALLBACKS_MAX
+#define RELOAD_CALLBACKS_MAX    4               // Maximum number of registered reload callbacks
+#endif
+
 #endif
\ No newline at end of file
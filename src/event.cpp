@@ -0,0 +1,89 @@
+/*
+
+EVENT MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "event.h"
+
+event_t _eventQueue[EVENT_QUEUE_SIZE];
+volatile unsigned char _eventHead = 0;
+volatile unsigned char _eventTail = 0;
+
+event_handler_t _eventHandlers[EVENT_TYPES][EVENT_HANDLERS_MAX];
+unsigned char _eventHandlerCount[EVENT_TYPES];
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void _eventDispatch(const event_t & event) {
+    for (unsigned char i = 0; i < _eventHandlerCount[event.type]; i++) {
+        (_eventHandlers[event.type][i])(event);
+    }
+}
+
+void _eventLoop() {
+
+    // Only deliver what is queued now, events published by the
+    // handlers themselves wait for the next run
+    unsigned char pending;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending = (_eventHead + EVENT_QUEUE_SIZE - _eventTail) % EVENT_QUEUE_SIZE;
+    }
+
+    while (pending--) {
+        event_t event = _eventQueue[_eventTail];
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _eventTail = (_eventTail + 1) % EVENT_QUEUE_SIZE;
+        }
+        _eventDispatch(event);
+    }
+
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Queues an event, safe to call from an ISR
+ * Returns false if the queue is full and the event was dropped
+ */
+bool eventPublish(unsigned char type, unsigned char id, unsigned char value) {
+    if (type >= EVENT_TYPES) return false;
+
+    bool queued = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        unsigned char next = (_eventHead + 1) % EVENT_QUEUE_SIZE;
+        if (next != _eventTail) {
+            _eventQueue[_eventHead] = (event_t) { type, id, value };
+            _eventHead = next;
+            queued = true;
+        }
+    }
+
+    if (queued) taskFlag(TASK_EVENT_BUS);
+    return queued;
+}
+
+bool eventPublish(unsigned char type) {
+    return eventPublish(type, 0, 0);
+}
+
+bool eventSubscribe(unsigned char type, event_handler_t handler) {
+    if (type >= EVENT_TYPES) return false;
+    if (_eventHandlerCount[type] >= EVENT_HANDLERS_MAX) return false;
+    _eventHandlers[type][_eventHandlerCount[type]++] = handler;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void eventSetup() {
+    taskRegister(_eventLoop, TASK_PERIOD_NONE, TASK_PRIORITY_HIGH, TASK_EVENT_BUS);
+}
@@ -0,0 +1,48 @@
+/*
+
+EVENT HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "task.h"
+
+// Event types, the meaning of id and value depends on the type
+#define EVENT_RELAY_CHANGED         0           // id: relay, value: new status
+#define EVENT_RELAY_COMMAND         1           // id: relay, value: 0 off, 1 on, 2 toggle, 3 query
+#define EVENT_LINK_UP               2           // Bridge reports the broker connection is up
+#define EVENT_LINK_DOWN             3           // Bridge reports the broker connection is down
+#define EVENT_RELAY_BITMAP          4           // Report the state of all relays at once
+#define EVENT_RELAY_SYNC            5           // Report the relay sequence, queued behind the changes it covers
+#define EVENT_TYPES                 6
+
+// A full report queues a change for every relay at once (RELAY_MAX in relay.h),
+// the rest is headroom for commands and link events published meanwhile
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE            40          // Pending events (max 255)
+#endif
+
+#ifndef EVENT_HANDLERS_MAX
+#define EVENT_HANDLERS_MAX          2           // Handlers per event type
+#endif
+
+typedef struct {
+    unsigned char type;
+    unsigned char id;
+    unsigned char value;
+} event_t;
+
+typedef void (*event_handler_t)(const event_t & event);
+
+bool eventPublish(unsigned char type, unsigned char id, unsigned char value);
+bool eventPublish(unsigned char type);
+bool eventSubscribe(unsigned char type, event_handler_t handler);
+void eventSetup();
+
+#endif
@@ -0,0 +1,201 @@
+/*
+
+MCP23017 EXPANDER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "expander.h"
+#include "relay.h"
+
+#if RELAY_PROVIDER == RELAY_PROVIDER_MCP23017
+
+#define EXPANDER_DIRTY_A            0x01        // OLATA needs writing
+#define EXPANDER_DIRTY_B            0x02        // OLATB needs writing
+#define EXPANDER_DIRTY_INIT         0x04        // IODIRA/IODIRB need writing
+
+// TWI status codes (prescaler bits masked out)
+#define TWI_START                   0x08
+#define TWI_REP_START               0x10
+#define TWI_MT_SLA_ACK              0x18
+#define TWI_MT_DATA_ACK             0x28
+
+// Output latch image of each expander, A and B registers
+unsigned char _expanderOlat[EXPANDER_COUNT][2];
+volatile unsigned char _expanderDirty[EXPANDER_COUNT];
+
+// Transaction in progress, register address followed by up to 2 data bytes
+unsigned char _expanderTx[3];
+volatile unsigned char _expanderTxLength = 0;
+volatile unsigned char _expanderTxIndex = 0;
+volatile unsigned char _expanderTxAddress = 0;
+volatile unsigned char _expanderTxDirty = 0;
+volatile unsigned char _expanderCurrent = 0;
+volatile bool _expanderBusy = false;
+volatile unsigned int _expanderErrors = 0;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+/**
+ * Picks the next expander with pending registers and issues a START
+ * Changes to both latches of an expander go out in a single transaction
+ * (registers auto-increment from OLATA to OLATB), so each register is
+ * written at most once per flush. Interrupts must be disabled.
+ */
+void _expanderNext() {
+
+    for (unsigned char n = 0; n < EXPANDER_COUNT; n++) {
+        unsigned char i = (_expanderCurrent + n) % EXPANDER_COUNT;
+        unsigned char dirty = _expanderDirty[i];
+        if (dirty == 0) continue;
+
+        if (dirty & (EXPANDER_DIRTY_A | EXPANDER_DIRTY_B)) {
+            // Latches go first so outputs never show a stale value
+            bool a = dirty & EXPANDER_DIRTY_A;
+            bool b = dirty & EXPANDER_DIRTY_B;
+            _expanderTxLength = 0;
+            _expanderTx[_expanderTxLength++] = a ? EXPANDER_OLATA : EXPANDER_OLATA + 1;
+            if (a) _expanderTx[_expanderTxLength++] = _expanderOlat[i][0];
+            if (b) _expanderTx[_expanderTxLength++] = _expanderOlat[i][1];
+            _expanderTxDirty = dirty & (EXPANDER_DIRTY_A | EXPANDER_DIRTY_B);
+        } else {
+            // Every pin as an output
+            _expanderTx[0] = EXPANDER_IODIRA;
+            _expanderTx[1] = 0x00;
+            _expanderTx[2] = 0x00;
+            _expanderTxLength = 3;
+            _expanderTxDirty = EXPANDER_DIRTY_INIT;
+        }
+
+        _expanderDirty[i] &= ~_expanderTxDirty;
+        _expanderCurrent = i;
+        _expanderTxAddress = EXPANDER_ADDRESS + i;
+        _expanderTxIndex = 0;
+        _expanderBusy = true;
+        TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+        return;
+    }
+
+    _expanderBusy = false;
+}
+
+void _expanderStop() {
+    TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+    // A START cannot be issued until the STOP is out, a few microseconds
+    while (TWCR & _BV(TWSTO));
+}
+
+// -----------------------------------------------------------------------------
+// Interrupts
+// -----------------------------------------------------------------------------
+
+ISR(TWI_vect) {
+    switch (TWSR & 0xF8) {
+
+        case TWI_START:
+        case TWI_REP_START:
+            TWDR = _expanderTxAddress << 1;
+            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+            break;
+
+        case TWI_MT_SLA_ACK:
+        case TWI_MT_DATA_ACK:
+            if (_expanderTxIndex < _expanderTxLength) {
+                TWDR = _expanderTx[_expanderTxIndex++];
+                TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+            } else {
+                _expanderStop();
+                _expanderCurrent = (_expanderCurrent + 1) % EXPANDER_COUNT;
+                _expanderNext();
+            }
+            break;
+
+        default:
+            // NACK or arbitration lost, the other expanders go on and the
+            // registers stay pending, so a missing one cannot hold the rest up
+            {
+                unsigned char failed = _expanderCurrent;
+                unsigned char dirty = _expanderTxDirty;
+                _expanderStop();
+                _expanderErrors++;
+                _expanderCurrent = (failed + 1) % EXPANDER_COUNT;
+                _expanderNext();
+                _expanderDirty[failed] |= dirty;
+            }
+            break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Only updates the latch image, nothing is sent until expanderFlush()
+ */
+void expanderWrite(unsigned char output, bool level) {
+    unsigned char expander = output >> 4;
+    if (expander >= EXPANDER_COUNT) return;
+
+    unsigned char port = (output >> 3) & 1;
+    unsigned char bit = 1 << (output & 7);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        unsigned char value = level ? (_expanderOlat[expander][port] | bit) : (_expanderOlat[expander][port] & ~bit);
+        if (value != _expanderOlat[expander][port]) {
+            _expanderOlat[expander][port] = value;
+            _expanderDirty[expander] |= port ? EXPANDER_DIRTY_B : EXPANDER_DIRTY_A;
+        }
+    }
+}
+
+/**
+ * Starts writing the pending registers in the background, returns immediately
+ * If a transfer is already running it will pick them up when done
+ */
+void expanderFlush() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!_expanderBusy) _expanderNext();
+    }
+}
+
+bool expanderBusy() {
+    return _expanderBusy;
+}
+
+unsigned int expanderErrors() {
+    unsigned int errors;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        errors = _expanderErrors;
+    }
+    return errors;
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+/**
+ * Call once the initial latch values have been set with expanderWrite()
+ */
+void expanderSetup() {
+
+    // Bit rate, prescaler 1
+    TWSR = 0;
+    TWBR = ((F_CPU / EXPANDER_I2C_SPEED) - 16) / 2;
+    TWCR = _BV(TWEN);
+
+    // Latches and then directions for every expander
+    for (unsigned char i = 0; i < EXPANDER_COUNT; i++) {
+        _expanderDirty[i] |= EXPANDER_DIRTY_A | EXPANDER_DIRTY_B | EXPANDER_DIRTY_INIT;
+    }
+
+    expanderFlush();
+
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[EXPANDER] %d MCP23017 configured\n"), EXPANDER_COUNT);
+}
+
+#endif // RELAY_PROVIDER == RELAY_PROVIDER_MCP23017
@@ -0,0 +1,39 @@
+/*
+
+MCP23017 EXPANDER HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef EXPANDER_H
+#define EXPANDER_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "debug.h"
+
+// Outputs are numbered expander * 16 + pin, pins 0-7 are GPA0-7 and 8-15 GPB0-7
+// The TWI peripheral is driven from its own ISR, do not link the Wire library
+#ifndef EXPANDER_COUNT
+#define EXPANDER_COUNT              1           // Expanders on the bus, addresses 0x20 upwards (max 8)
+#endif
+
+#ifndef EXPANDER_ADDRESS
+#define EXPANDER_ADDRESS            0x20        // Address of the first expander (A2-A0 tied low)
+#endif
+
+#ifndef EXPANDER_I2C_SPEED
+#define EXPANDER_I2C_SPEED          400000
+#endif
+
+#define EXPANDER_IODIRA             0x00
+#define EXPANDER_OLATA              0x14
+
+void expanderWrite(unsigned char output, bool level);
+void expanderFlush();
+bool expanderBusy();
+unsigned int expanderErrors();
+void expanderSetup();
+
+#endif
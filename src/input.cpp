@@ -0,0 +1,158 @@
+/*
+
+INPUT MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "input.h"
+
+typedef struct {
+    unsigned char state;        // Debounced state, 1 means pressed
+    unsigned char ct0;          // Vertical counter, low bit for each input
+    unsigned char ct1;          // Vertical counter, high bit for each input
+    unsigned char mask;         // Pins used as inputs
+} input_bank_t;
+
+input_bank_t _inputBanks[INPUT_BANKS];
+
+// Bindings
+unsigned char _inputRelay[INPUT_MAX];
+unsigned char _inputMode[INPUT_MAX];
+
+// Set by the pin-change interrupts, kept while a bank is still bouncing
+volatile bool _inputActive = false;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+unsigned char _inputSample(unsigned char bank) {
+    // Active low, the whole port is read at once
+    unsigned char pins = (bank == 0) ? PINK : PINB;
+    return ~pins & _inputBanks[bank].mask;
+}
+
+/**
+ * Vertical counter debouncing, 8 inputs at a time
+ * Each input has a 2 bit counter spread over ct0/ct1 that is reset
+ * whenever the sample equals the debounced state, the state toggles
+ * when the counter rolls over (4 consecutive different samples)
+ * Returns the inputs that changed
+ */
+unsigned char _inputDebounce(input_bank_t & bank, unsigned char sample) {
+    unsigned char delta = bank.state ^ sample;
+    bank.ct0 = ~(bank.ct0 & delta);
+    bank.ct1 = bank.ct0 ^ (bank.ct1 & delta);
+    delta &= bank.ct0 & bank.ct1;
+    bank.state ^= delta;
+    return delta;
+}
+
+void _inputPressed(unsigned char id) {
+    unsigned char relay = _inputRelay[id];
+
+    DEBUG_LOG_P(DEBUG_MODULE_INPUT, DEBUG_LEVEL_VERBOSE, PSTR("[INPUT] #%d pressed\n"), id);
+
+    // Local action first, the relay module reports the change upstream
+    switch (_inputMode[id]) {
+        case INPUT_MODE_TOGGLE:
+            relayToggle(relay);
+            break;
+        case INPUT_MODE_ON:
+            relayStatus(relay, true);
+            break;
+        case INPUT_MODE_OFF:
+            relayStatus(relay, false);
+            break;
+        case INPUT_MODE_PULSE:
+            relayPulse(relay, INPUT_PULSE_TIME);
+            break;
+        default:
+            break;
+    }
+}
+
+void _inputLoop() {
+    // Cleared before sampling, so an edge during the pass runs us again
+    bool active;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        active = _inputActive;
+        _inputActive = false;
+    }
+    if (!active) return;
+
+    bool stable = true;
+    for (unsigned char bank = 0; bank < INPUT_BANKS; bank++) {
+        if (_inputBanks[bank].mask == 0) continue;
+
+        unsigned char sample = _inputSample(bank);
+        unsigned char changed = _inputDebounce(_inputBanks[bank], sample);
+        unsigned char pressed = changed & _inputBanks[bank].state;
+
+        for (unsigned char bit = 0; pressed; bit++, pressed >>= 1) {
+            if (pressed & 1) _inputPressed(bank * 8 + bit);
+        }
+
+        if (sample != _inputBanks[bank].state) stable = false;
+    }
+
+    if (!stable) _inputActive = true;
+}
+
+void _inputConfigure() {
+    for (unsigned char id = 0; id < INPUT_MAX; id++) {
+        _inputRelay[id] = getSetting(K_INPUT_RELAY, id, id).toInt();
+        _inputMode[id] = getSetting(K_INPUT_MODE, id, INPUT_MODE_NONE).toInt();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Interrupts
+// -----------------------------------------------------------------------------
+
+ISR(PCINT2_vect) {
+    _inputActive = true;
+    taskFlag(TASK_EVENT_INPUT);
+}
+
+ISR(PCINT0_vect) {
+    _inputActive = true;
+    taskFlag(TASK_EVENT_INPUT);
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void inputSetup() {
+
+    _inputBanks[0].mask = INPUT_BANK0_MASK;
+    _inputBanks[1].mask = INPUT_BANK1_MASK;
+
+    // Inputs with pull-ups
+    DDRK &= ~INPUT_BANK0_MASK;
+    PORTK |= INPUT_BANK0_MASK;
+    DDRB &= ~INPUT_BANK1_MASK;
+    PORTB |= INPUT_BANK1_MASK;
+
+    // Start from the current state, switches already closed at boot do not fire
+    for (unsigned char bank = 0; bank < INPUT_BANKS; bank++) {
+        _inputBanks[bank].state = _inputSample(bank);
+        _inputBanks[bank].ct0 = 0xFF;
+        _inputBanks[bank].ct1 = 0xFF;
+    }
+
+    _inputConfigure();
+
+    // Pin-change interrupts
+    PCMSK2 = INPUT_BANK0_MASK;
+    PCMSK0 = INPUT_BANK1_MASK;
+    PCIFR = _BV(PCIE2) | _BV(PCIE0);
+    if (INPUT_BANK0_MASK) PCICR |= _BV(PCIE2);
+    if (INPUT_BANK1_MASK) PCICR |= _BV(PCIE0);
+
+    taskRegister(_inputLoop, INPUT_SAMPLE_INTERVAL, TASK_PRIORITY_CRITICAL, TASK_EVENT_INPUT);
+    espurnaRegisterReload(_inputConfigure);
+}
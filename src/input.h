@@ -0,0 +1,54 @@
+/*
+
+INPUT HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "settings.h"
+#include "relay.h"
+#include "task.h"
+#include "debug.h"
+
+#define INPUT_MODE_NONE             0
+#define INPUT_MODE_TOGGLE           1
+#define INPUT_MODE_ON               2
+#define INPUT_MODE_OFF              3
+#define INPUT_MODE_PULSE            4
+
+// Switch banks, 8 inputs each, read as a whole port with pin-change interrupts
+// Bank 0 is PORTK (A8-A15), bank 1 is PORTB (D53, D52, D51, D50, D10-D13)
+// Input ID is bank * 8 + bit, switches pull the pin to GND
+// Masked pins are made inputs with pull-ups after relaySetup, so they must
+// not overlap relay outputs. Nothing is taken unless enabled here
+#define INPUT_BANKS                 2
+#define INPUT_MAX                   (INPUT_BANKS * 8)
+
+#ifndef INPUT_BANK0_MASK
+#define INPUT_BANK0_MASK            0x00        // PORTK pins used as inputs
+#endif
+
+#ifndef INPUT_BANK1_MASK
+#define INPUT_BANK1_MASK            0x00        // PORTB pins used as inputs (PB0-PB3 are the SPI pins)
+#endif
+
+// Sampling period while a switch is bouncing, a change is accepted
+// after 4 equal samples so press to relay takes under 5ms
+#ifndef INPUT_SAMPLE_INTERVAL
+#define INPUT_SAMPLE_INTERVAL       1
+#endif
+
+// Pulse length for INPUT_MODE_PULSE in milliseconds
+#ifndef INPUT_PULSE_TIME
+#define INPUT_PULSE_TIME            (RELAY_PULSE_TIME * 1000)
+#endif
+
+void inputSetup();
+
+#endif
@@ -8,15 +8,27 @@ Copyright (C) 2019 by Shaeed Khan
 
 #include <Arduino.h>
 
+#include "def.h"
 #include "prototypes.h"
 #include "debug.h"
+#include "channel.h"
 #include "settings.h"
 #include "utils.h"
-#include "uartmqtt.h"
+#include "uart.h"
+#include "task.h"
+#include "event.h"
+#include "relay.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "input.h"
+#include "system.h"
+#include "accounting.h"
 #include "Vector.h"
 
-Vector<void (*)()> _loop_callbacks;
-Vector<void (*)()> _reload_callbacks;
+void (*_loop_callbacks_storage[LOOP_CALLBACKS_MAX])();
+void (*_reload_callbacks_storage[RELOAD_CALLBACKS_MAX])();
+Vector<void (*)()> _loop_callbacks(_loop_callbacks_storage);
+Vector<void (*)()> _reload_callbacks(_reload_callbacks_storage);
 
 void espurnaRegisterLoop(void (*callback)()) {
     _loop_callbacks.push_back(callback);
@@ -34,11 +46,29 @@ void espurnaReload() {
 
 void setup() {
 
+  channelSetup();
+
   debugSetup();
 
+  taskSetup();
+
+  eventSetup();
+
   settingsSetup();
 
+  systemSetup();
+
   uartmqttSetup();
+
+  accountingSetup();
+
+  relaySetup();
+
+  sceneSetup();
+
+  schedulerSetup();
+
+  inputSetup();
 }
 
 void loop() {
@@ -46,7 +76,4 @@ void loop() {
   for (unsigned char i = 0; i < _loop_callbacks.size(); i++) {
     (_loop_callbacks[i])();
   }
-  
-  _uartmqttLoop();
-  //_relayLoop();
 }
\ No newline at end of file
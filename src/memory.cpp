@@ -0,0 +1,167 @@
+/*
+
+MEMORY MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "memory.h"
+
+#ifdef __AVR__
+
+// avr-libc internals
+struct __freelist {
+    size_t sz;
+    struct __freelist * nx;
+};
+extern struct __freelist * __flp;
+extern char * __brkval;
+extern char __heap_start;
+extern char _end;
+extern size_t __malloc_margin;
+
+#endif
+
+#if MEMORY_ALLOC_TRACKING
+    memory_owner_t _memoryOwners[MEMORY_OWNERS_MAX];
+    unsigned char _memoryOwnerCount = 0;
+#endif
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+#ifdef __AVR__
+
+/**
+ * Paints everything above .bss/.noinit with the canary before any code runs
+ * Plain assembly, r1 is not cleared yet at .init1
+ */
+void _memoryPaint() __attribute__ ((naked, used, section (".init1")));
+void _memoryPaint() {
+    __asm volatile (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        :: "M" (MEMORY_CANARY)
+    );
+}
+
+#endif
+
+#if MEMORY_ALLOC_TRACKING
+
+memory_owner_t * _memoryOwner() {
+    void (*owner)() = taskRunning();
+    for (unsigned char i = 0; i < _memoryOwnerCount; i++) {
+        if (_memoryOwners[i].owner == owner) return &_memoryOwners[i];
+    }
+    if (_memoryOwnerCount == MEMORY_OWNERS_MAX) return NULL;
+    memory_owner_t * entry = &_memoryOwners[_memoryOwnerCount++];
+    entry->owner = owner;
+    return entry;
+}
+
+extern "C" {
+
+void * __real_malloc(size_t size);
+void __real_free(void * ptr);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+    void * ptr = __real_malloc(size);
+    memory_owner_t * entry = _memoryOwner();
+    if (entry) {
+        entry->allocs++;
+        if (ptr == NULL) entry->failed++;
+    }
+    return ptr;
+}
+
+void __wrap_free(void * ptr) {
+    if (ptr == NULL) return;
+    __real_free(ptr);
+    memory_owner_t * entry = _memoryOwner();
+    if (entry) entry->frees++;
+}
+
+// Counted as a new block and the old one freed, allocs - frees stays the live blocks
+void * __wrap_realloc(void * ptr, size_t size) {
+    void * result = __real_realloc(ptr, size);
+    memory_owner_t * entry = _memoryOwner();
+    if (entry) {
+        if (size > 0) entry->allocs++;
+        if (ptr != NULL && (result != NULL || size == 0)) entry->frees++;
+        if (result == NULL && size > 0) entry->failed++;
+    }
+    return result;
+}
+
+}
+
+#endif // MEMORY_ALLOC_TRACKING
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+void memoryStats(memory_stats_t * stats) {
+
+    #ifndef __AVR__
+        // Host build (native tests), there is no avr-libc heap to walk
+        memset(stats, 0, sizeof(memory_stats_t));
+        return;
+    #else
+
+    char * heap_end = __brkval ? __brkval : &__heap_start;
+    char * stack = (char *) SP;
+
+    // The painted area ends where the deepest stack frame reached
+    char * p = heap_end;
+    while (p < stack && *p == (char) MEMORY_CANARY) p++;
+    stats->unused = p - heap_end;
+    stats->stack_max = (char *) RAMEND - p;
+
+    stats->heap_size = heap_end - &__heap_start;
+
+    // Free list blocks, then the gap malloc() can still take from the stack side
+    unsigned int total = 0;
+    unsigned int largest = 0;
+    for (struct __freelist * block = __flp; block; block = block->nx) {
+        total += block->sz;
+        if (block->sz > largest) largest = block->sz;
+    }
+
+    unsigned int gap = (stack > heap_end + __malloc_margin) ? stack - heap_end - __malloc_margin : 0;
+    total += gap;
+    if (gap > largest) largest = gap;
+
+    stats->heap_free = total;
+    stats->largest = largest;
+    stats->fragmentation = total ? 100 - (unsigned long) largest * 100 / total : 0;
+
+    #endif
+}
+
+unsigned char memoryOwners() {
+    #if MEMORY_ALLOC_TRACKING
+        return _memoryOwnerCount;
+    #else
+        return 0;
+    #endif
+}
+
+const memory_owner_t * memoryOwner(unsigned char index) {
+    #if MEMORY_ALLOC_TRACKING
+        if (index < _memoryOwnerCount) return &_memoryOwners[index];
+    #endif
+    return NULL;
+}
@@ -0,0 +1,49 @@
+/*
+
+MEMORY HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "task.h"
+
+// Byte written over the free RAM at boot, whatever is left of it was never used by the stack
+#define MEMORY_CANARY               0xC5
+
+// Count allocations per task, needs -Wl,--wrap=malloc,--wrap=free,--wrap=realloc
+#ifndef MEMORY_ALLOC_TRACKING
+#define MEMORY_ALLOC_TRACKING       0
+#endif
+
+#ifndef MEMORY_OWNERS_MAX
+#define MEMORY_OWNERS_MAX           8           // Tasks tracked, code outside tasks included
+#endif
+
+typedef struct {
+    unsigned int stack_max;         // Deepest stack use since boot
+    unsigned int unused;            // Bytes between the heap and the deepest stack never touched
+    unsigned int heap_size;         // Bytes taken by the heap (brk - heap start)
+    unsigned int heap_free;         // Bytes in the free list plus the gap up to the stack
+    unsigned int largest;           // Largest block malloc() can return right now
+    unsigned char fragmentation;    // 100 - largest * 100 / heap_free
+} memory_stats_t;
+
+typedef struct {
+    void (*owner)();                // Task callback, NULL outside tasks
+    unsigned int allocs;            // Blocks from malloc() and realloc()
+    unsigned int frees;             // Blocks given back by free() and realloc()
+    unsigned int failed;            // Allocations that returned NULL
+} memory_owner_t;
+
+void memoryStats(memory_stats_t * stats);
+unsigned char memoryOwners();
+const memory_owner_t * memoryOwner(unsigned char index);
+
+#endif
@@ -6,6 +6,8 @@ Copyright (C) 2019 by Shaeed Khan
 
 */
 #include "relay.h"
+#include "accounting.h"
+#include "system.h"
 
 typedef struct {
 
@@ -13,6 +15,7 @@ typedef struct {
 
     unsigned char pin;          // GPIO pin for the relay
     unsigned char type;         // RELAY_TYPE_NORMAL, RELAY_TYPE_INVERSE, RELAY_TYPE_LATCHED or RELAY_TYPE_LATCHED_INVERSE
+    unsigned char boot_mode;    // RELAY_BOOT_OFF, RELAY_BOOT_ON, RELAY_BOOT_SAME or RELAY_BOOT_TOGGLE
     //unsigned char reset_pin;    // GPIO to reset the relay if RELAY_TYPE_LATCHED
     //unsigned long delay_on;     // Delay to turn relay ON
     //unsigned long delay_off;    // Delay to turn relay OFF
@@ -31,17 +34,144 @@ typedef struct {
 
     // Helping objects
 
-    //Ticker pulseTicker;         // Holds the pulse back timer
+    unsigned long pulse_end;    // Switch back OFF at this time, 0 if no pulse running
+    unsigned int seq;           // Sequence number of the last physical change
 
 } relay_t;
-Vector<relay_t> _relays;
+relay_t _relays_storage[RELAY_MAX];
+Vector<relay_t> _relays(_relays_storage);
 bool _relayRecursive = false;
+unsigned char _relayPulses = 0;         // Number of pulses running
+
+// Every physical change gets the next sequence number and goes into the log,
+// so a reconnecting bridge only needs what happened after the last one it saw
+typedef struct {
+    unsigned int seq;
+    unsigned char id;
+} relay_log_t;
+relay_log_t _relayLog[RELAY_LOG_SIZE];
+unsigned char _relayLogHead = 0;        // Next slot to write, the oldest entry once full
+unsigned char _relayLogCount = 0;
+unsigned int _relaySeq = 0;
+unsigned int _relayEpoch = 0;           // Changes whenever the log starts over, sequences of another epoch are meaningless
+
+unsigned int _relayCommandsDropped = 0; // Lost to a full event queue
+
+typedef struct {
+    unsigned char first;
+    unsigned char last;
+    unsigned long ms;
+} relay_expr_pulse_t;
+
+// Relay state kept across warm resets (watchdog, reset pin), the C runtime does not clear it
+typedef struct {
+    unsigned int magic;
+    unsigned char count;
+    unsigned char current[RELAY_BYTES];     // Physical status
+    unsigned char target[RELAY_BYTES];      // Requested status, ahead of current while changes are pending
+    unsigned int epoch;                     // Sequence log, carried on instead of starting a new epoch
+    unsigned int seq;
+    unsigned int crc;                       // Over everything from count
+} relay_retain_t;
+relay_retain_t _relayRetain __attribute__ ((section (".noinit")));
+
+#if RELAY_INRUSH_MAX > 0
+    // ON transitions waiting for budget, in arrival order, and a bit per queued relay
+    unsigned char _relayInrushQueue[RELAY_MAX];
+    unsigned char _relayInrushLength = 0;
+    unsigned char _relayInrushFlags[RELAY_BYTES];
+    unsigned char _relayInrushCount[(RELAY_MAX + RELAY_INRUSH_BANK_SIZE - 1) / RELAY_INRUSH_BANK_SIZE];
+    unsigned long _relayInrushSlice = 0;
+#endif
+
+#if RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+    // Output latch image of the 74HC595 chain, byte 0 is the first register
+    unsigned char _relayShiftShadow[RELAY_BYTES];
+    bool _relayShiftDirty = false;
+#endif
 //Ticker _relaySaveTicker;
 
+// -----------------------------------------------------------------------------
+// WARM RESET RETENTION
+// -----------------------------------------------------------------------------
+
+unsigned int _relayRetainCrc() {
+    unsigned int crc = 0xFFFF;
+    const unsigned char * p = &_relayRetain.count;
+    const unsigned char * end = (const unsigned char *) &_relayRetain.crc;
+    while (p < end) crc = _crc16_update(crc, *p++);
+    return crc;
+}
+
+void _relayRetainBit(unsigned char * bitmap, unsigned char id, bool status) {
+    unsigned char bit = 1 << (id & 7);
+    if (status) {
+        bitmap[id >> 3] |= bit;
+    } else {
+        bitmap[id >> 3] &= ~bit;
+    }
+    _relayRetain.crc = _relayRetainCrc();
+}
+
+/**
+ * Only after a reset that kept the RAM powered
+ */
+bool _relayRetainValid() {
+    if (systemResetReason() & (_BV(PORF) | _BV(BORF))) return false;
+    if (_relayRetain.magic != RELAY_RETAIN_MAGIC) return false;
+    if (_relayRetain.count != _relays.size()) return false;
+    return _relayRetain.crc == _relayRetainCrc();
+}
+
+// Outputs are all OFF after _relayConfigure, the loop drives them to their targets
+void _relayRetainInit() {
+    memset(&_relayRetain, 0, sizeof(_relayRetain));
+    _relayRetain.magic = RELAY_RETAIN_MAGIC;
+    _relayRetain.count = _relays.size();
+    _relayRetain.epoch = _relayEpoch;
+    _relayRetain.seq = _relaySeq;
+    for (unsigned char id = 0; id < _relays.size(); id++) {
+        if (_relays[id].target_status) _relayRetain.target[id >> 3] |= (1 << (id & 7));
+    }
+    _relayRetain.crc = _relayRetainCrc();
+}
+
 // -----------------------------------------------------------------------------
 // RELAY PROVIDERS
 // -----------------------------------------------------------------------------
 
+#if RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+
+void _relayShiftWrite(unsigned char output, bool level) {
+    if (output >= 8 * RELAY_BYTES) return;
+    unsigned char bit = 1 << (output & 7);
+    if (level) {
+        _relayShiftShadow[output >> 3] |= bit;
+    } else {
+        _relayShiftShadow[output >> 3] &= ~bit;
+    }
+    _relayShiftDirty = true;
+}
+
+/**
+ * Clocks the whole chain out and latches every output at once
+ * The last register in the chain has to be shifted first
+ */
+void _relayShiftFlush() {
+    if (!_relayShiftDirty) return;
+    _relayShiftDirty = false;
+
+    SPI.beginTransaction(SPISettings(RELAY_SHIFT_SPI_SPEED, MSBFIRST, SPI_MODE0));
+    digitalWrite(RELAY_SHIFT_LATCH_PIN, LOW);
+    for (unsigned char i = RELAY_BYTES; i > 0; i--) {
+        SPI.transfer(_relayShiftShadow[i - 1]);
+    }
+    digitalWrite(RELAY_SHIFT_LATCH_PIN, HIGH);
+    SPI.endTransaction();
+}
+
+#endif // RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+
 void _relayProviderStatus(unsigned char id, bool status) {
     // Check relay ID
     if (id >= _relays.size()) return;
@@ -49,15 +179,122 @@ void _relayProviderStatus(unsigned char id, bool status) {
     // Store new current status
     _relays[id].current_status = status;
 
+    // Log the change
+    _relays[id].seq = ++_relaySeq;
+    _relayLog[_relayLogHead].seq = _relaySeq;
+    _relayLog[_relayLogHead].id = id;
+    _relayLogHead = (_relayLogHead + 1) % RELAY_LOG_SIZE;
+    if (_relayLogCount < RELAY_LOG_SIZE) _relayLogCount++;
+
+    _relayRetain.seq = _relaySeq;
+    _relayRetainBit(_relayRetain.current, id, status);
+
+    // On time and switch counters
+    accountingSwitch(id, status);
+
+    bool level;
     if (_relays[id].type == RELAY_TYPE_NORMAL) {
-        digitalWrite(_relays[id].pin, status);
+        level = status;
     } else if (_relays[id].type == RELAY_TYPE_INVERSE) {
-        digitalWrite(_relays[id].pin, !status);
+        level = !status;
     } else { 
-        DEBUG_MSG_P(PSTR("[RELAY] Invalid type for #%d %s\n"), id);
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_ERROR, PSTR("[RELAY] Invalid type for #%d\n"), id);
+        return;
     }
+
+    #if RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+        // pin is the output position in the chain, written on the next flush
+        _relayShiftWrite(_relays[id].pin, level);
+    #elif RELAY_PROVIDER == RELAY_PROVIDER_MCP23017
+        // pin is the expander output, written on the next flush
+        expanderWrite(_relays[id].pin, level);
+    #elif ZEROCROSS_SUPPORT
+        // Written from the zero-cross interrupt after the next flush
+        if (GPIO_NONE != _relays[id].pin) zerocrossWrite(_relays[id].pin, level);
+    #else
+        digitalWrite(_relays[id].pin, level);
+    #endif
+}
+
+// Relays that boot from the saved status need every change committed
+bool _relayCommits(unsigned char id) {
+    return (RELAY_BOOT_SAME == _relays[id].boot_mode) || (RELAY_BOOT_TOGGLE == _relays[id].boot_mode);
 }
 
+/**
+ * Switches the relay to its target status and reports it
+ */
+void _relaySwitch(unsigned char id) {
+
+    bool target = _relays[id].target_status;
+
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[RELAY] #%d set to %s\n"), id, target ? "ON" : "OFF");
+
+    // Call the provider to perform the action
+    _relayProviderStatus(id, target);
+
+    // Report the change
+    relayMQTT(id);
+
+    if (!_relayRecursive) relaySave(_relayCommits(id));
+
+    _relays[id].report = false;
+    _relays[id].group_report = false;
+}
+
+#if RELAY_INRUSH_MAX > 0
+
+bool _relayInrushQueued(unsigned char id) {
+    return (_relayInrushFlags[id >> 3] & (1 << (id & 7))) != 0;
+}
+
+/**
+ * Takes one ON transition from the bank budget of the current slice
+ */
+bool _relayInrushAdmit(unsigned char id) {
+    unsigned long now = millis();
+    if (now - _relayInrushSlice >= RELAY_INRUSH_SLICE) {
+        _relayInrushSlice = now;
+        memset(_relayInrushCount, 0, sizeof(_relayInrushCount));
+    }
+
+    unsigned char bank = id / RELAY_INRUSH_BANK_SIZE;
+    if (_relayInrushCount[bank] >= RELAY_INRUSH_MAX) return false;
+    _relayInrushCount[bank]++;
+    return true;
+}
+
+void _relayInrushPush(unsigned char id) {
+    if (_relayInrushQueued(id)) return;
+    _relayInrushFlags[id >> 3] |= (1 << (id & 7));
+    _relayInrushQueue[_relayInrushLength++] = id;
+}
+
+/**
+ * Switches the queued relays that are due and whose bank has budget left,
+ * in order, the rest stay queued for the next slices
+ */
+void _relayInrushDrain() {
+    unsigned long current_time = millis();
+    unsigned char kept = 0;
+    for (unsigned char i = 0; i < _relayInrushLength; i++) {
+        unsigned char id = _relayInrushQueue[i];
+
+        // Still waiting to go ON, not before its change_time (flood protection)
+        bool pending = _relays[id].target_status && !_relays[id].current_status;
+        if (pending && ((current_time < _relays[id].change_time) || !_relayInrushAdmit(id))) {
+            _relayInrushQueue[kept++] = id;
+            continue;
+        }
+
+        _relayInrushFlags[id >> 3] &= ~(1 << (id & 7));
+        if (pending) _relaySwitch(id);
+    }
+    _relayInrushLength = kept;
+}
+
+#endif // RELAY_INRUSH_MAX > 0
+
 /**
  * Walks the relay vector processing only those relays
  * that have to change to the requested mode
@@ -67,6 +304,11 @@ void _relayProcess(bool mode) {
 
     unsigned long current_time = millis();
 
+    #if RELAY_INRUSH_MAX > 0
+        // Only walk the queue while there is something in it
+        if (mode && _relayInrushLength > 0) _relayInrushDrain();
+    #endif
+
     for (unsigned char id = 0; id < _relays.size(); id++) {
 
         bool target = _relays[id].target_status;
@@ -80,25 +322,29 @@ void _relayProcess(bool mode) {
         // Only process if the change_time has arrived
         if (current_time < _relays[id].change_time) continue;
 
-        DEBUG_MSG_P(PSTR("[RELAY] #%d set to %s\n"), id, target ? "ON" : "OFF");
-
-        // Call the provider to perform the action
-        _relayProviderStatus(id, target);
-
-        // Send MQTT
-        #if MQTT_SUPPORT
-            relayMQTT(id);
+        #if RELAY_INRUSH_MAX > 0
+            // ON transitions over the bank budget wait in the queue, OFF ones never do
+            if (mode) {
+                if (_relayInrushQueued(id)) continue;
+                if (!_relayInrushAdmit(id)) {
+                    _relayInrushPush(id);
+                    continue;
+                }
+            }
         #endif
 
-        if (!_relayRecursive) {
-            unsigned char boot_mode = getSetting(K_RELAY_BOOT_MODE, id, RELAY_BOOT_MODE).toInt();
-            bool do_commit = ((RELAY_BOOT_SAME == boot_mode) || (RELAY_BOOT_TOGGLE == boot_mode));
-            relaySave(do_commit);
-        }
-
-        _relays[id].report = false;
-        _relays[id].group_report = false;
+        _relaySwitch(id);
     }
+
+    #if RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+        _relayShiftFlush();
+    #elif RELAY_PROVIDER == RELAY_PROVIDER_MCP23017
+        // Coalesced register writes, sent from the TWI interrupt
+        expanderFlush();
+    #elif ZEROCROSS_SUPPORT
+        // Everything switched in this pass goes out on the same crossing
+        zerocrossFlush();
+    #endif
 }
 
 bool relayStatus(unsigned char id, bool status, bool report, bool group_report) {
@@ -109,6 +355,16 @@ bool relayStatus(unsigned char id, bool status, bool report, bool group_report)
 
     if (_relays[id].current_status == status) {
 
+        // Held back by the flood protection, the last request wins
+        if (_relays[id].target_status != status) {
+            DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] #%d scheduled change cancelled\n"), id);
+            _relays[id].target_status = status;
+            _relayRetainBit(_relayRetain.target, id, status);
+            _relays[id].report = false;
+            _relays[id].group_report = false;
+            changed = true;
+        }
+
     } else {
         unsigned long current_time = millis();
         unsigned long fw_end = _relays[id].fw_start + 1000 * RELAY_FLOOD_WINDOW;
@@ -133,14 +389,18 @@ bool relayStatus(unsigned char id, bool status, bool report, bool group_report)
         }
 
         _relays[id].target_status = status;
+        _relayRetainBit(_relayRetain.target, id, status);
         if (report) _relays[id].report = true;
         if (group_report) _relays[id].group_report = true;
 
-        DEBUG_MSG_P(PSTR("[RELAY] #%d scheduled %s in %u ms\n"),
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] #%d scheduled %s in %u ms\n"),
                 id, status ? "ON" : "OFF",
                 (_relays[id].change_time - current_time));
 
         changed = true;
+
+        // Do not wait for the next period to switch
+        taskFlag(TASK_EVENT_RELAY);
     }
 
     return changed;
@@ -185,7 +445,7 @@ void relaySave(bool do_commit) {
         
         if(do_commit && save){
             setSetting(K_RELAY_STATUS_ALL, j, mask);
-            DEBUG_MSG_P(PSTR("[RELAY] Setting relay mask: %d\n"), mask);
+            DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] Setting relay mask: %d\n"), mask);
         }
     }//End outer for loop
 }
@@ -203,6 +463,187 @@ void relayToggle(unsigned char id) {
     relayToggle(id, true, true);
 }
 
+/**
+ * Only the timer, the caller has already scheduled the relay ON
+ * The pulse starts when the relay does, even if the flood protection holds it back
+ */
+void _relayPulseArm(unsigned char id, unsigned long ms) {
+    unsigned long start = millis();
+    if (!_relays[id].current_status && (start < _relays[id].change_time)) start = _relays[id].change_time;
+
+    if (_relays[id].pulse_end == 0) _relayPulses++;
+    _relays[id].pulse_end = start + ms;
+    if (_relays[id].pulse_end == 0) _relays[id].pulse_end = 1;
+}
+
+/**
+ * Switches the relay ON and back OFF after the given milliseconds
+ */
+void relayPulse(unsigned char id, unsigned long ms) {
+    if (id >= _relays.size()) return;
+
+    relayStatus(id, true);
+    _relayPulseArm(id, ms);
+}
+
+void _relayPulseCheck() {
+    unsigned long now = millis();
+    for (unsigned char id = 0; id < _relays.size(); id++) {
+        if (_relays[id].pulse_end == 0) continue;
+        if ((long) (now - _relays[id].pulse_end) < 0) continue;
+        _relays[id].pulse_end = 0;
+        _relayPulses--;
+        relayStatus(id, false);
+    }
+}
+
+/**
+ * Schedules every relay in mask to its bit in target, switches whatever
+ * is due in a single pass and reports all of them at once
+ */
+void relayApply(const unsigned char * target, const unsigned char * mask) {
+
+    unsigned char count = _relays.size();
+    unsigned char scheduled[RELAY_BYTES] = {0};
+    bool changed = false;
+
+    for (unsigned char id = 0; id < count; id++) {
+        unsigned char bit = 1 << (id & 7);
+        if ((mask[id >> 3] & bit) == 0) continue;
+        if (relayStatus(id, (target[id >> 3] & bit) != 0, false, false)) {
+            scheduled[id >> 3] |= bit;
+            changed = true;
+        }
+    }
+
+    if (!changed) return;
+
+    // Same ordering as the loop, but a single save for the whole batch
+    _relayRecursive = true;
+    _relayLoop();
+    _relayRecursive = false;
+
+    // Committed only if a relay that boots from the saved status switched,
+    // same rule as _relaySwitch
+    bool do_commit = false;
+    for (unsigned char id = 0; id < count; id++) {
+        if ((scheduled[id >> 3] & (1 << (id & 7))) == 0) continue;
+        if (_relays[id].target_status != _relays[id].current_status) continue;
+        if (_relayCommits(id)) {
+            do_commit = true;
+            break;
+        }
+    }
+    relaySave(do_commit);
+
+    // Relays held back by the flood protection report on their own once switched
+    for (unsigned char id = 0; id < count; id++) {
+        if (_relays[id].target_status != _relays[id].current_status) {
+            _relays[id].report = true;
+        }
+    }
+
+    eventPublish(EVENT_RELAY_BITMAP);
+}
+
+/**
+ * Parses a range expression such as "1-8:on,12:toggle,20-23:pulse500"
+ * Actions are on/off/toggle (or 1/0/2) and pulse<ms>, later terms win
+ * The expression is read in place, nothing is changed if it is malformed
+ */
+bool relayExpression(const char * expr) {
+
+    unsigned char set[RELAY_BYTES] = {0};
+    unsigned char clear[RELAY_BYTES] = {0};
+    unsigned char toggle[RELAY_BYTES] = {0};
+    relay_expr_pulse_t pulses[RELAY_EXPR_PULSES];
+    unsigned char pulse_count = 0;
+
+    if (_relays.size() == 0) return false;
+
+    const char * p = expr;
+    while (true) {
+
+        // Range
+        char * end;
+        if (!isdigit(*p)) return false;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            if (!isdigit(*p)) return false;
+            last = strtoul(p, &end, 10);
+            if (last < first) return false;
+        }
+        if (*end != ':') return false;
+        p = end + 1;
+
+        // Action, up to the next term
+        const char * next = strchr(p, ',');
+        size_t len = next ? (size_t) (next - p) : strlen(p);
+        unsigned char action;
+        unsigned long ms = 0;
+        if ((len == 1 && *p == '1') || (len == 2 && strncasecmp_P(p, PSTR("on"), 2) == 0)) {
+            action = 1;
+        } else if ((len == 1 && *p == '0') || (len == 3 && strncasecmp_P(p, PSTR("off"), 3) == 0)) {
+            action = 0;
+        } else if ((len == 1 && *p == '2') || (len == 6 && strncasecmp_P(p, PSTR("toggle"), 6) == 0)) {
+            action = 2;
+        } else if (len > 5 && strncasecmp_P(p, PSTR("pulse"), 5) == 0) {
+            ms = strtoul(p + 5, &end, 10);
+            if (end != p + len || ms == 0) return false;
+            if (pulse_count == RELAY_EXPR_PULSES) return false;
+            action = 3;
+        } else {
+            return false;
+        }
+
+        if (last >= _relays.size()) last = _relays.size() - 1;
+        if (action == 3 && first <= last) {
+            pulses[pulse_count++] = (relay_expr_pulse_t) { (unsigned char) first, (unsigned char) last, ms };
+        }
+
+        for (unsigned long id = first; id <= last; id++) {
+            unsigned char bit = 1 << (id & 7);
+            unsigned char byte = id >> 3;
+            set[byte] &= ~bit;
+            clear[byte] &= ~bit;
+            toggle[byte] &= ~bit;
+            if (action == 0) clear[byte] |= bit;
+            if (action == 1 || action == 3) set[byte] |= bit;
+            if (action == 2) toggle[byte] |= bit;
+        }
+
+        if (next == NULL) break;
+        p = next + 1;
+    }
+
+    // Compose a single batch for relayApply
+    unsigned char target[RELAY_BYTES];
+    unsigned char mask[RELAY_BYTES];
+    for (unsigned char i = 0; i < RELAY_BYTES; i++) {
+        unsigned char current = 0;
+        for (unsigned char j = 0; j < 8; j++) {
+            unsigned char id = 8 * i + j;
+            if (id >= _relays.size()) break;
+            if (_relays[id].current_status) current |= (1 << j);
+        }
+        target[i] = set[i] | (~current & toggle[i]);
+        mask[i] = set[i] | clear[i] | toggle[i];
+    }
+    relayApply(target, mask);
+
+    // Relays still set by their own term switch back OFF on their own, they are
+    // already part of the batch so only the timer is armed (one flood count each)
+    for (unsigned char k = 0; k < pulse_count; k++) {
+        for (unsigned char id = pulses[k].first; id <= pulses[k].last; id++) {
+            if (set[id >> 3] & (1 << (id & 7))) _relayPulseArm(id, pulses[k].ms);
+        }
+    }
+
+    return true;
+}
+
 unsigned char relayCount() {
     return _relays.size();
 }
@@ -216,24 +657,18 @@ unsigned char relayParsePayload(const char * payload) {
     if (payload[0] == '1') return 1;
     if (payload[0] == '2') return 2;
 
-    // trim payload
-    char * p = ltrim((char *)payload);
-
-    // to lower
-    unsigned int l = strlen(p);
-    if (l>6) l=6;
-    for (unsigned char i=0; i<l; i++) {
-        p[i] = tolower(p[i]);
-    }
+    // trim payload, the caller's buffer is left untouched
+    const char * p = payload;
+    while (*p == ' ') ++p;
 
-    unsigned int value = 0xFF;
-    if (strcmp(p, "off") == 0) {
+    unsigned char value = 0xFF;
+    if (strcasecmp_P(p, PSTR("off")) == 0) {
         value = 0;
-    } else if (strcmp(p, "on") == 0) {
+    } else if (strcasecmp_P(p, PSTR("on")) == 0) {
         value = 1;
-    } else if (strcmp(p, "toggle") == 0) {
+    } else if (strcasecmp_P(p, PSTR("toggle")) == 0) {
         value = 2;
-    } else if (strcmp(p, "query") == 0) {
+    } else if (strcasecmp_P(p, PSTR("query")) == 0) {
         value = 3;
     }
 
@@ -242,6 +677,27 @@ unsigned char relayParsePayload(const char * payload) {
 
 void _relayBoot() {
 
+    // Warm reset, the RAM copy is newer than anything saved
+    if (_relayRetainValid()) {
+        for (unsigned char id = 0; id < _relays.size(); id++) {
+            bool status = (_relayRetain.target[id >> 3] & (1 << (id & 7))) != 0;
+            _relays[id].current_status = !status;
+            _relays[id].target_status = status;
+        }
+
+        // Same sequence log, the bridge resyncs against it as if nothing happened
+        _relayEpoch = _relayRetain.epoch;
+        _relaySeq = _relayRetain.seq;
+
+        _relayRetainInit();
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[RELAY] Status restored after warm reset\n"));
+        return;
+    }
+
+    // Cold boot, the sequence log starts over under a new epoch
+    _relayEpoch = getSetting(K_RELAY_EPOCH, 0).toInt() + 1;
+    setSetting(K_RELAY_EPOCH, _relayEpoch);
+
     _relayRecursive = true;
     bool trigger_save = false;
     unsigned char bit = 1;
@@ -253,13 +709,13 @@ void _relayBoot() {
         unsigned char sizeOfCurrentBatch = _relays.size() > 8*(j+1) ? 8 : _relays.size()-8*j;
         bit = 1;
         mask = getSetting(K_RELAY_STATUS_ALL, j, 0x00).toInt();
-        DEBUG_MSG_P(PSTR("[RELAY] Retrieving mask: %d\n"), mask);
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] Retrieving mask: %d\n"), mask);
         trigger_save = false;
 
         for (unsigned char i = 0; i < sizeOfCurrentBatch; i++) {
             unsigned char currentRelay = i + 8* j;
-            unsigned char boot_mode = getSetting(K_RELAY_BOOT_MODE, currentRelay, RELAY_BOOT_MODE).toInt();
-            DEBUG_MSG_P(PSTR("[RELAY] Relay #%d boot mode %d\n"), currentRelay, boot_mode);
+            unsigned char boot_mode = _relays[currentRelay].boot_mode;
+            DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] Relay #%d boot mode %d\n"), currentRelay, boot_mode);
 
             status = false;
             switch (boot_mode) {
@@ -295,10 +751,45 @@ void _relayBoot() {
         }
     }
 
+    _relayRetainInit();
     _relayRecursive = false;
 }
 
 void _relayConfigure() {
+    #if RELAY_PROVIDER == RELAY_PROVIDER_SHIFT
+        SPI.begin();
+        pinMode(RELAY_SHIFT_LATCH_PIN, OUTPUT);
+        digitalWrite(RELAY_SHIFT_LATCH_PIN, HIGH);
+
+        // Every output OFF, taking inverse relays into account
+        memset(_relayShiftShadow, 0, sizeof(_relayShiftShadow));
+        for (unsigned char i = 0; i < _relays.size(); i++) {
+            if (_relays[i].type == RELAY_TYPE_INVERSE) _relayShiftWrite(_relays[i].pin, true);
+        }
+        _relayShiftDirty = true;
+        _relayShiftFlush();
+
+        // Outputs are only enabled once they hold a known state
+        if (GPIO_NONE != RELAY_SHIFT_OE_PIN) {
+            pinMode(RELAY_SHIFT_OE_PIN, OUTPUT);
+            digitalWrite(RELAY_SHIFT_OE_PIN, LOW);
+        }
+        return;
+    #endif
+
+    #if RELAY_PROVIDER == RELAY_PROVIDER_MCP23017
+        // Every output OFF, taking inverse relays into account
+        for (unsigned char i = 0; i < _relays.size(); i++) {
+            expanderWrite(_relays[i].pin, _relays[i].type == RELAY_TYPE_INVERSE);
+        }
+        expanderSetup();
+        return;
+    #endif
+
+    #if ZEROCROSS_SUPPORT
+        zerocrossSetup();
+    #endif
+
     for (char i = 0; i < _relays.size(); i++) {
         if (GPIO_NONE == _relays[i].pin) continue;
 
@@ -314,30 +805,59 @@ void _relayConfigure() {
 }
 
 //------------------------------------------------------------------------------
-// MQTT
+// REPORTING
 //------------------------------------------------------------------------------
 
 void relayMQTT(unsigned char id) {
 
     if (id >= _relays.size()) return;
 
-    // Send state topic
+    // Send state
     if (_relays[id].report) {
         _relays[id].report = false;
-        mqttSend(MQTT_TOPIC_RELAY, id, _relays[id].current_status ? RELAY_MQTT_ON : RELAY_MQTT_OFF);
+        eventPublish(EVENT_RELAY_CHANGED, id, _relays[id].current_status);
     }
-
-    // Send speed for IFAN02
-    /*#if defined (ITEAD_SONOFF_IFAN02)
-        char buffer[5];
-        snprintf(buffer, sizeof(buffer), "%u", getSpeed());
-        mqttSend(MQTT_TOPIC_SPEED, buffer);
-    #endif*/
 }
 
 void relayMQTT() {
     for (unsigned int id=0; id < _relays.size(); id++) {
-        mqttSend(MQTT_TOPIC_RELAY, id, _relays[id].current_status ? RELAY_MQTT_ON : RELAY_MQTT_OFF);
+        eventPublish(EVENT_RELAY_CHANGED, id, _relays[id].current_status);
+    }
+}
+
+unsigned int relaySequence() {
+    return _relaySeq;
+}
+
+unsigned int relayEpoch() {
+    return _relayEpoch;
+}
+
+unsigned int relayCommandsDropped() {
+    return _relayCommandsDropped;
+}
+
+/**
+ * Reports what changed after sequence seq of the given epoch
+ * Only the latest change of each relay is sent, everything else
+ * (another boot, log wrapped, bridge ahead of us) gets the full bitmap
+ */
+void relayResync(unsigned int epoch, unsigned int seq) {
+
+    unsigned int behind = _relaySeq - seq;
+    if (behind == 0 && epoch == _relayEpoch) return;
+
+    if (epoch != _relayEpoch || behind > _relayLogCount) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[RELAY] Full resync from %u:%u\n"), epoch, seq);
+        eventPublish(EVENT_RELAY_BITMAP);
+        return;
+    }
+
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[RELAY] Resync %u changes\n"), behind);
+    for (unsigned char k = behind; k > 0; k--) {
+        const relay_log_t & entry = _relayLog[(_relayLogHead + RELAY_LOG_SIZE - k) % RELAY_LOG_SIZE];
+        if (_relays[entry.id].seq != entry.seq) continue;
+        eventPublish(EVENT_RELAY_CHANGED, entry.id, _relays[entry.id].current_status);
     }
 }
 
@@ -359,59 +879,76 @@ void relayStatusWrap(unsigned char id, unsigned char value) {
     }
 }
 
-void relayMQTTCallback(unsigned int type, const char * topic, const char * payload) {
+void _relayEventCallback(const event_t & event) {
 
-    if (type == MQTT_CONNECT_EVENT) {
+    // Nothing is sent on connect, the bridge asks with relayResync() for what it missed
 
-        // Send status on connect
-        relayMQTT();
+    if (event.type == EVENT_RELAY_COMMAND) {
 
-        // Subscribe to own /set topic
-        char relay_topic[strlen(MQTT_TOPIC_RELAY) + 3];
-        snprintf_P(relay_topic, sizeof(relay_topic), PSTR("%s/+"), MQTT_TOPIC_RELAY);
-        mqttSubscribe(relay_topic);
+        if (event.id >= relayCount()) {
+            DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Wrong relayID (%d)\n"), event.id);
+            return;
+        }
+
+        relayStatusWrap(event.id, event.value);
     }
+}
 
-    if (type == MQTT_MESSAGE_EVENT) {
+// relay/<id>
+void _relayTopicCallback(const unsigned int * args, const char * payload) {
 
-        String t = mqttMagnitude((char *) topic);
+    unsigned int id = args[0];
+    if (id >= relayCount()) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Wrong relayID (%d)\n"), id);
+        return;
+    }
 
-        // magnitude is relay/#
-        if (t.startsWith(MQTT_TOPIC_RELAY)) {
+    // Get value
+    unsigned char value = relayParsePayload(payload);
+    if (value == 0xFF) return;
 
-            // Get relay ID
-            unsigned int id = t.substring(strlen(MQTT_TOPIC_RELAY)+1).toInt();
-            if (id >= relayCount()) {
-                DEBUG_MSG_P(PSTR("[RELAY] Wrong relayID (%d)\n"), id);
-                return;
-            }
+    // Queue full, the bridge only notices from the missing report
+    if (!eventPublish(EVENT_RELAY_COMMAND, id, value)) {
+        _relayCommandsDropped++;
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Event queue full, command for #%d dropped\n"), id);
+    }
+}
 
-            // Get value
-            unsigned char value = relayParsePayload(payload);
-            if (value == 0xFF) return;
+// relay/<id>/pulse
+void _relayPulseCallback(const unsigned int * args, const char * payload) {
 
-            relayStatusWrap(id, value, false);
+    unsigned int id = args[0];
+    if (id >= relayCount()) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Wrong relayID (%d)\n"), id);
+        return;
+    }
 
-            return;
-        }
+    char * end;
+    unsigned long ms = strtoul(payload, &end, 10);
+    if (ms == 0 || *end != '\0') {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Wrong pulse length (%s)\n"), payload);
+        return;
     }
 
-    if (type == MQTT_DISCONNECT_EVENT) {
-        /*for (unsigned int i=0; i < _relays.size(); i++){
-            int reaction = getSetting("relayOnDisc", i, 0).toInt();
-            if (1 == reaction) {     // switch relay OFF
-                DEBUG_MSG_P(PSTR("[RELAY] Reset relay (%d) due to MQTT disconnection\n"), i);
-                relayStatusWrap(i, false, false);
-            } else if(2 == reaction) { // switch relay ON
-                DEBUG_MSG_P(PSTR("[RELAY] Set relay (%d) due to MQTT disconnection\n"), i);
-                relayStatusWrap(i, true, false);
-            }
-        }*/
+    relayPulse(id, ms);
+}
+
+// relay/expr
+void _relayExpressionCallback(const unsigned int *, const char * payload) {
+    if (!relayExpression(payload)) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[RELAY] Wrong expression (%s)\n"), payload);
     }
 }
 
-void relaySetupMQTT() {
-    mqttRegister(relayMQTTCallback);
+void _relaySetupEvents() {
+    topicRegister(MQTT_TOPIC_RELAY "/+", _relayTopicCallback);
+    topicRegister(MQTT_TOPIC_RELAY "/+/" MQTT_TOPIC_PULSE, _relayPulseCallback);
+    topicRegister(MQTT_TOPIC_RELAY "/" MQTT_TOPIC_EXPRESSION, _relayExpressionCallback);
+    uartmqttSubscribe(MQTT_TOPIC_RELAY "/+");
+    uartmqttSubscribe(MQTT_TOPIC_RELAY "/+/" MQTT_TOPIC_PULSE);
+    uartmqttSubscribe(MQTT_TOPIC_RELAY "/" MQTT_TOPIC_EXPRESSION);
+
+    eventSubscribe(EVENT_RELAY_COMMAND, _relayEventCallback);
 }
 
 
@@ -420,6 +957,9 @@ void relaySetupMQTT() {
 //------------------------------------------------------------------------------
 
 void _relayLoop() {
+    // Only walk the relays while there are pulses running
+    if (_relayPulses > 0) _relayPulseCheck();
+
     _relayProcess(false);
     _relayProcess(true);
 }
@@ -430,6 +970,7 @@ void relaySetup() {
     for(char i = 0; i < noOfRelays; i++) {
         _relays.push_back((relay_t) { getSetting(K_RELAY_PIN, i, GPIO_NONE).toInt(),
                                     getSetting(K_RELAY_TYPE, i, RELAY_TYPE_INVERSE).toInt(),
+                                    getSetting(K_RELAY_BOOT_MODE, i, RELAY_BOOT_MODE).toInt(),
                                     //GPIO_NONE,
                                     //RELAY_DELAY_ON,
                                     //RELAY_DELAY_OFF 
@@ -440,11 +981,11 @@ void relaySetup() {
     _relayBoot();
     _relayLoop();
 
-    relaySetupMQTT();
+    _relaySetupEvents();
 
     // Main callbacks
-    espurnaRegisterLoop(_relayLoop);
+    taskRegister(_relayLoop, RELAY_LOOP_INTERVAL, TASK_PRIORITY_CRITICAL, TASK_EVENT_RELAY);
     espurnaRegisterReload(_relayConfigure);
 
-    DEBUG_MSG_P(PSTR("[RELAY] Number of relays: %d\n"), _relays.size());
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[RELAY] Number of relays: %d\n"), _relays.size());
 }
@@ -2,13 +2,21 @@
 #define RELAY_H
 
 #include <EEPROM.h>
+#include <SPI.h>
+#include <util/crc16.h>
 //#include <Ticker.h>
 #include <ArduinoJson.h>
-#include "vector.h"
+#include "Vector.h"
 //#include <functional>
 #include "settings.h"
 #include "debug.h"
 #include "utils.h"
+#include "expander.h"
+#include "zerocross.h"
+#include "task.h"
+#include "event.h"
+#include "topic.h"
+#include "uart.h"
 
 #define GPIO_NONE           0x99
 #define RELAY_DELAY_ON       0
@@ -38,11 +46,74 @@
 #define RELAY_PROVIDER_LIGHT        2
 #define RELAY_PROVIDER_RFBRIDGE     3
 #define RELAY_PROVIDER_STM          4
+#define RELAY_PROVIDER_SHIFT        5           // Chained 74HC595 shift registers on hardware SPI
+#define RELAY_PROVIDER_MCP23017     6           // MCP23017 I2C port expanders
 
 #define RELAY_GROUP_SYNC_NORMAL      0
 #define RELAY_GROUP_SYNC_INVERSE     1
 #define RELAY_GROUP_SYNC_RECEIVEONLY 2
 
+// How relays are driven, RELAY_PROVIDER_RELAY (GPIO), RELAY_PROVIDER_SHIFT or RELAY_PROVIDER_MCP23017
+// For RELAY_PROVIDER_MCP23017 the relay pin setting is the expander output (see expander.h)
+#ifndef RELAY_PROVIDER
+#define RELAY_PROVIDER              RELAY_PROVIDER_RELAY
+#endif
+
+// 74HC595 chain: relay pin setting is the output number in the chain (0 is Q0 of the first register)
+// SPI MOSI (51) goes to DS and SCK (52) to SH_CP of the first register
+#ifndef RELAY_SHIFT_LATCH_PIN
+#define RELAY_SHIFT_LATCH_PIN       53          // ST_CP of every register
+#endif
+
+#ifndef RELAY_SHIFT_OE_PIN
+#define RELAY_SHIFT_OE_PIN          GPIO_NONE   // Output enable (active low), pulled up externally
+#endif
+
+#ifndef RELAY_SHIFT_SPI_SPEED
+#define RELAY_SHIFT_SPI_SPEED       8000000
+#endif
+
+// Maximum number of relays, each one takes 21 bytes of RAM
+#ifndef RELAY_MAX
+#define RELAY_MAX                   32
+#endif
+
+// Bytes needed to hold one bit per relay
+#define RELAY_BYTES                 ((RELAY_MAX + 7) / 8)
+
+#if EVENT_QUEUE_SIZE < RELAY_MAX + 8
+#error "EVENT_QUEUE_SIZE is too small for a full relay report (RELAY_MAX + 8)"
+#endif
+
+// Relay changes kept for resync after a reconnect, 3 bytes each
+// A bridge further behind gets the full bitmap
+#ifndef RELAY_LOG_SIZE
+#define RELAY_LOG_SIZE              8
+#endif
+
+// Inrush limiting: at most RELAY_INRUSH_MAX relays of the same bank are switched ON
+// every RELAY_INRUSH_SLICE ms, the rest are queued in order. OFF is never delayed
+// 0 disables it
+#ifndef RELAY_INRUSH_MAX
+#define RELAY_INRUSH_MAX            0
+#endif
+
+#ifndef RELAY_INRUSH_SLICE
+#define RELAY_INRUSH_SLICE          100
+#endif
+
+// Relays sharing a supply, relay IDs 0 to RELAY_INRUSH_BANK_SIZE - 1 are the first bank
+#ifndef RELAY_INRUSH_BANK_SIZE
+#define RELAY_INRUSH_BANK_SIZE      8
+#endif
+
+#define RELAY_RETAIN_MAGIC          0x5AA5      // Marks a valid warm reset copy of the relay status
+
+// Pulse terms allowed in a single relay expression
+#ifndef RELAY_EXPR_PULSES
+#define RELAY_EXPR_PULSES           4
+#endif
+
 // Default boot mode: 0 means OFF, 1 ON and 2 whatever was before
 #ifndef RELAY_BOOT_MODE
 #define RELAY_BOOT_MODE             RELAY_BOOT_OFF
@@ -83,6 +154,11 @@
 #define RELAY_SAVE_DELAY            1000
 #endif
 
+// Check for scheduled changes every these many milliseconds
+#ifndef RELAY_LOOP_INTERVAL
+#define RELAY_LOOP_INTERVAL         10
+#endif
+
 // Configure the MQTT payload for ON/OFF
 #ifndef RELAY_MQTT_ON
 #define RELAY_MQTT_ON               "1"
@@ -91,6 +167,8 @@
 #define RELAY_MQTT_OFF              "0"
 #endif
 
+// Legacy layout, not used: the settings dictionary spans the whole EEPROM
+// (crash counter in K_CRASH_COUNT, relay on time and switches in K_ACCOUNTING)
 #define EEPROM_RELAY_STATUS     0               // Address for the relay status (1 byte)
 #define EEPROM_ENERGY_COUNT     1               // Address for the energy counter (4 bytes)
 #define EEPROM_CUSTOM_RESET     5               // Address for the reset reason (1 byte)
@@ -100,10 +178,13 @@
 #define EEPROM_DATA_END         14              // End of custom EEPROM data block
 
 #define MQTT_TOPIC_RELAY            "relay"
+#define MQTT_TOPIC_EXPRESSION       "expr"          // relay/expr, see relayExpression()
+#define MQTT_TOPIC_PULSE            "pulse"         // relay/<id>/pulse, payload is the pulse length in ms
 
 void _relayProviderStatus(unsigned char id, bool status);
+void _relaySwitch(unsigned char id);
 void _relayProcess(bool mode);
-void relayPulse(unsigned char id);
+void relayPulse(unsigned char id, unsigned long ms);
 bool relayStatus(unsigned char id, bool status, bool report, bool group_report);
 bool relayStatus(unsigned char id, bool status);
 bool relayStatus(unsigned char id);
@@ -112,16 +193,22 @@ void relaySave(bool do_commit);
 void relaySave();
 void relayToggle(unsigned char id, bool report, bool group_report);
 void relayToggle(unsigned char id);
+void relayApply(const unsigned char * target, const unsigned char * mask);
+bool relayExpression(const char * expr);
 unsigned char relayCount();
 unsigned char relayParsePayload(const char * payload);
+bool _relayRetainValid();
+void _relayRetainInit();
 void _relayBoot();
 void _relayConfigure();
 void _relayMQTTGroup(unsigned char id);
 void relayMQTT(unsigned char id);
 void relayMQTT();
-void relayStatusWrap(unsigned char id, unsigned char value, bool is_group_topic);
-void relayMQTTCallback(unsigned int type, const char * topic, const char * payload);
-void relaySetupMQTT();
+unsigned int relaySequence();
+unsigned int relayEpoch();
+unsigned int relayCommandsDropped();
+void relayResync(unsigned int epoch, unsigned int seq);
+void relayStatusWrap(unsigned char id, unsigned char value);
 void _relayLoop();
 void relaySetup();
 
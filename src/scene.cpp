@@ -0,0 +1,111 @@
+/*
+
+SCENE MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "scene.h"
+
+typedef struct {
+    unsigned char target[RELAY_BYTES];  // Requested state, one bit per relay
+    unsigned char mask[RELAY_BYTES];    // Relays affected by the scene
+} scene_t;
+
+// RAM copy of the scenes stored in EEPROM
+scene_t _scenes[SCENE_MAX];
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void _sceneLoad(unsigned char id) {
+    memset(&_scenes[id], 0, sizeof(scene_t));
+    hexDecode(getSetting(K_SCENE_TARGET, id, "").c_str(), _scenes[id].target, RELAY_BYTES);
+    hexDecode(getSetting(K_SCENE_MASK, id, "").c_str(), _scenes[id].mask, RELAY_BYTES);
+}
+
+// group/<id>
+void _sceneGroupCallback(const unsigned int * args, const char * payload) {
+
+    unsigned int id = args[0];
+    if (id >= SCENE_MAX) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[SCENE] Wrong group ID (%d)\n"), id);
+        return;
+    }
+
+    unsigned char value = relayParsePayload(payload);
+    if (value > 2) return;
+
+    // The whole group in a single batch
+    unsigned char target[RELAY_BYTES];
+    memset(target, value == 1 ? 0xFF : 0x00, RELAY_BYTES);
+    if (value == 2) {
+        for (unsigned char i = 0; i < relayCount(); i++) {
+            if (!relayStatus(i)) target[i >> 3] |= (1 << (i & 7));
+        }
+    }
+    relayApply(target, _scenes[id].mask);
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+bool sceneSave(unsigned char id, const unsigned char * target, const unsigned char * mask, const char * name) {
+    if (id >= SCENE_MAX) return false;
+
+    memcpy(_scenes[id].target, target, RELAY_BYTES);
+    memcpy(_scenes[id].mask, mask, RELAY_BYTES);
+
+    char buffer[2 * RELAY_BYTES + 1];
+    hexEncode(target, RELAY_BYTES, buffer);
+    setSetting(K_SCENE_TARGET, id, buffer);
+    hexEncode(mask, RELAY_BYTES, buffer);
+    setSetting(K_SCENE_MASK, id, buffer);
+    if (name && *name) {
+        setSetting(K_SCENE_NAME, id, name);
+    } else {
+        delSetting(K_SCENE_NAME, id);
+    }
+
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[SCENE] Scene #%d saved\n"), id);
+    return true;
+}
+
+bool sceneGet(unsigned char id, unsigned char * target, unsigned char * mask) {
+    if (id >= SCENE_MAX) return false;
+    memcpy(target, _scenes[id].target, RELAY_BYTES);
+    memcpy(mask, _scenes[id].mask, RELAY_BYTES);
+    return true;
+}
+
+// Only read when the bridge asks, so it stays in EEPROM
+String sceneName(unsigned char id) {
+    return getSetting(K_SCENE_NAME, id, "");
+}
+
+bool sceneApply(unsigned char id) {
+    if (id >= SCENE_MAX) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_WARNING, PSTR("[SCENE] Wrong scene ID (%d)\n"), id);
+        return false;
+    }
+
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[SCENE] Applying scene #%d\n"), id);
+    relayApply(_scenes[id].target, _scenes[id].mask);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void sceneSetup() {
+    for (unsigned char id = 0; id < SCENE_MAX; id++) {
+        _sceneLoad(id);
+    }
+
+    topicRegister(MQTT_TOPIC_GROUP "/+", _sceneGroupCallback);
+    uartmqttSubscribe(MQTT_TOPIC_GROUP "/+");
+}
@@ -0,0 +1,34 @@
+/*
+
+SCENE HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "relay.h"
+#include "debug.h"
+#include "utils.h"
+#include "topic.h"
+#include "uart.h"
+
+// Each scene takes 2 * RELAY_BYTES of RAM
+#ifndef SCENE_MAX
+#define SCENE_MAX                   8
+#endif
+
+// group/<id> switches every relay in the mask of scene <id> (on, off or toggle)
+#define MQTT_TOPIC_GROUP            "group"
+
+bool sceneSave(unsigned char id, const unsigned char * target, const unsigned char * mask, const char * name);
+bool sceneGet(unsigned char id, unsigned char * target, unsigned char * mask);
+String sceneName(unsigned char id);
+bool sceneApply(unsigned char id);
+void sceneSetup();
+
+#endif
@@ -0,0 +1,161 @@
+/*
+
+SCHEDULER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "scheduler.h"
+
+typedef struct {
+    unsigned int minute;        // Minute of the week, 0 is Sunday 00:00
+    unsigned char relay;        // Relay ID
+    unsigned char action;       // SCHEDULER_ACTION_OFF, SCHEDULER_ACTION_ON or SCHEDULER_ACTION_TOGGLE
+} schedule_t;
+
+// Sorted by minute
+schedule_t _schedules[SCHEDULER_MAX];
+unsigned char _schedulerCount = 0;
+
+// Next event due and last minute already processed
+unsigned char _schedulerNext = 0;
+unsigned int _schedulerLast = 0;
+
+// Wall clock pushed by the bridge (local time)
+unsigned long _schedulerEpoch = 0;
+unsigned long _schedulerSyncMillis = 0;
+bool _schedulerSynced = false;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+unsigned int _schedulerMinuteOfWeek() {
+    unsigned long now = _schedulerEpoch + (millis() - _schedulerSyncMillis) / 1000;
+    unsigned long minutes = now / 60;
+    // 1970-01-01 was a Thursday
+    unsigned int day = ((minutes / 1440) + 4) % 7;
+    return day * 1440 + (minutes % 1440);
+}
+
+// True if minute is in the (from, to] window, wrapping around the end of the week
+bool _schedulerInRange(unsigned int minute, unsigned int from, unsigned int to) {
+    if (from <= to) return (from < minute) && (minute <= to);
+    return (minute > from) || (minute <= to);
+}
+
+// Points _schedulerNext to the first event after the given minute
+void _schedulerSeek(unsigned int minute) {
+    _schedulerNext = 0;
+    while (_schedulerNext < _schedulerCount && _schedules[_schedulerNext].minute <= minute) {
+        _schedulerNext++;
+    }
+    if (_schedulerNext == _schedulerCount) _schedulerNext = 0;
+    _schedulerLast = minute;
+}
+
+void _schedulerFire(const schedule_t & schedule) {
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[SCHEDULER] Relay #%d action %d\n"), schedule.relay, schedule.action);
+    if (schedule.action == SCHEDULER_ACTION_TOGGLE) {
+        relayToggle(schedule.relay);
+    } else {
+        relayStatus(schedule.relay, schedule.action == SCHEDULER_ACTION_ON);
+    }
+}
+
+void _schedulerLoad() {
+    _schedulerCount = 0;
+    for (unsigned char i = 0; i < SCHEDULER_MAX; i++) {
+        String value = getSetting(K_SCHEDULE, i, "");
+        if (value.length() == 0) continue;
+
+        // Packed as MMMMRRAA in hex
+        unsigned long packed = strtoul(value.c_str(), NULL, 16);
+        schedule_t schedule = {
+            (unsigned int) (packed >> 16),
+            (unsigned char) (packed >> 8),
+            (unsigned char) packed
+        };
+        if (schedule.minute >= SCHEDULER_MINUTES_WEEK || schedule.action > SCHEDULER_ACTION_TOGGLE) continue;
+
+        // Insertion sort, the table is small and only built at boot or on changes
+        unsigned char j = _schedulerCount++;
+        while (j > 0 && _schedules[j - 1].minute > schedule.minute) {
+            _schedules[j] = _schedules[j - 1];
+            j--;
+        }
+        _schedules[j] = schedule;
+    }
+
+    if (_schedulerSynced) _schedulerSeek(_schedulerMinuteOfWeek());
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[SCHEDULER] %d events loaded\n"), _schedulerCount);
+}
+
+/**
+ * Only the next due event is looked at, so each run is O(1)
+ * unless several events share the same minute
+ */
+void _schedulerLoop() {
+    if (!_schedulerSynced || _schedulerCount == 0) return;
+
+    unsigned int now = _schedulerMinuteOfWeek();
+    if (now == _schedulerLast) return;
+
+    for (unsigned char i = 0; i < _schedulerCount; i++) {
+        const schedule_t & schedule = _schedules[_schedulerNext];
+        if (!_schedulerInRange(schedule.minute, _schedulerLast, now)) break;
+        _schedulerFire(schedule);
+        if (++_schedulerNext == _schedulerCount) _schedulerNext = 0;
+    }
+
+    _schedulerLast = now;
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Sets the wall clock, events missed while unsynced are not fired
+ */
+void schedulerSetTime(unsigned long epoch) {
+    _schedulerEpoch = epoch;
+    _schedulerSyncMillis = millis();
+    _schedulerSynced = true;
+    _schedulerSeek(_schedulerMinuteOfWeek());
+}
+
+/**
+ * Stores the event packed as minute << 16 | relay << 8 | action
+ * 0 is a valid event (Sunday 00:00, relay 0 OFF), use schedulerDelete()
+ * Returns false without writing anything if the event is out of range
+ */
+bool schedulerSave(unsigned char index, unsigned long packed) {
+    if (index >= SCHEDULER_MAX) return false;
+    if ((packed >> 16) >= SCHEDULER_MINUTES_WEEK) return false;
+    if ((packed & 0xFF) > SCHEDULER_ACTION_TOGGLE) return false;
+
+    char buffer[9];
+    snprintf_P(buffer, sizeof(buffer), PSTR("%08lX"), packed);
+    setSetting(K_SCHEDULE, index, buffer);
+
+    _schedulerLoad();
+    return true;
+}
+
+bool schedulerDelete(unsigned char index) {
+    if (index >= SCHEDULER_MAX) return false;
+    delSetting(K_SCHEDULE, index);
+    _schedulerLoad();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void schedulerSetup() {
+    _schedulerLoad();
+    taskRegister(_schedulerLoop, SCHEDULER_INTERVAL, TASK_PRIORITY_NORMAL);
+}
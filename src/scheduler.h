@@ -0,0 +1,39 @@
+/*
+
+SCHEDULER HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "relay.h"
+#include "task.h"
+#include "debug.h"
+
+#define SCHEDULER_ACTION_OFF        0
+#define SCHEDULER_ACTION_ON         1
+#define SCHEDULER_ACTION_TOGGLE     2
+
+#define SCHEDULER_MINUTES_WEEK      10080       // 7 * 24 * 60
+
+// Each event takes 4 bytes of RAM
+#ifndef SCHEDULER_MAX
+#define SCHEDULER_MAX               16
+#endif
+
+// Check for due events every these many milliseconds
+#ifndef SCHEDULER_INTERVAL
+#define SCHEDULER_INTERVAL          1000
+#endif
+
+void schedulerSetTime(unsigned long epoch);
+bool schedulerSave(unsigned char index, unsigned long packed);
+bool schedulerDelete(unsigned char index);
+void schedulerSetup();
+
+#endif
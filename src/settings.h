@@ -21,6 +21,16 @@ Copyright (C) 2019 by Shaeed Khan
 #define K_RELAY_TYPE      "c"
 #define K_RELAY_STATUS_ALL "d"
 #define K_RELAY_BOOT_MODE  "e"
+#define K_SCENE_TARGET     "f"
+#define K_SCENE_MASK       "g"
+#define K_SCENE_NAME       "h"
+#define K_SCHEDULE         "i"
+#define K_BUS_ADDRESS      "j"
+#define K_INPUT_RELAY      "k"
+#define K_INPUT_MODE       "l"
+#define K_RELAY_EPOCH      "m"
+#define K_CRASH_COUNT      "n"
+#define K_ACCOUNTING       "o"
 
 
 template<typename T> String getSetting(const String& key, T defaultValue);
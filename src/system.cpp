@@ -0,0 +1,166 @@
+/*
+
+SYSTEM MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "system.h"
+
+// Not cleared by the C runtime, survive a watchdog reset
+system_crash_t _systemCrash __attribute__ ((section (".noinit")));
+unsigned char _systemMcusr __attribute__ ((section (".noinit")));
+
+// Valid copy of the context if the last reset was a captured stall
+system_crash_t _systemLastCrash;
+bool _systemCrashed = false;
+unsigned int _systemCrashCount = 0;
+
+volatile unsigned long _systemLoopStart = 0;
+volatile unsigned long _systemLoopTime = 0;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+#ifdef __AVR__
+
+/**
+ * Runs before the C runtime init, MCUSR must be cleared right away or
+ * the watchdog stays enabled after the reset and keeps resetting us
+ */
+void _systemReadMcusr() __attribute__ ((naked, used, section (".init3")));
+void _systemReadMcusr() {
+    _systemMcusr = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+#endif
+
+/**
+ * Interrupt and reset mode, the interrupt fires first and the hardware
+ * switches back to reset only, so a second timeout resets the board
+ */
+void _systemWatchdogEnable() {
+    unsigned char prescaler = (SYSTEM_WDT_TIMEOUT & 0x07) | ((SYSTEM_WDT_TIMEOUT & 0x08) ? _BV(WDP3) : 0);
+    cli();
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | _BV(WDE) | prescaler;
+    sei();
+}
+
+ISR(WDT_vect) {
+    _systemCrash.callback = (unsigned int) (uintptr_t) taskRunning();
+    _systemCrash.duration = millis() - _systemLoopStart;
+    _systemCrash.last = _systemLoopTime;
+    _systemCrash.sp = SP;
+    _systemCrash.magic = SYSTEM_CRASH_MAGIC;
+}
+
+void _systemLoop() {
+    unsigned long now = millis();
+    _systemLoopTime = now - _systemLoopStart;
+    _systemLoopStart = now;
+
+    wdt_reset();
+
+    // The interrupt fired but the loop came back before the reset
+    if ((WDTCSR & _BV(WDIE)) == 0) {
+        DEBUG_LOG_P(DEBUG_MODULE_SYSTEM, DEBUG_LEVEL_ERROR, PSTR("[SYSTEM] Recovered from stall in 0x%04X\n"), _systemCrash.callback);
+        _systemCrash.magic = 0;
+        _systemWatchdogEnable();
+    } else if (_systemLoopTime > SYSTEM_STALL_TIME) {
+        DEBUG_LOG_P(DEBUG_MODULE_SYSTEM, DEBUG_LEVEL_WARNING, PSTR("[SYSTEM] Loop took %lu ms\n"), _systemLoopTime);
+    }
+}
+
+void _systemTelemetry() {
+    memory_stats_t stats;
+    memoryStats(&stats);
+
+    char buffer[80];
+    int length = snprintf_P(buffer, sizeof(buffer), PSTR("up=%lu loop=%lu crashes=%u stack=%u heap=%u largest=%u\n"),
+        millis() / 1000, _systemLoopTime, _systemCrashCount, stats.stack_max, stats.heap_free, stats.largest);
+
+    // Dropped if the previous line is still going out
+    if (length > 0 && length < (int) sizeof(buffer)) channelWrite(CHANNEL_DIAG, buffer, length);
+}
+
+void _systemCheckCrash() {
+
+    if ((_systemMcusr & _BV(WDRF)) && (_systemCrash.magic == SYSTEM_CRASH_MAGIC)) {
+        _systemLastCrash = _systemCrash;
+        _systemCrashed = true;
+    }
+
+    // Garbage after a power on, consumed otherwise
+    _systemCrash.magic = 0;
+
+    _systemCrashCount = getSetting(K_CRASH_COUNT, 0).toInt();
+    if (_systemCrashed) {
+        setSetting(K_CRASH_COUNT, ++_systemCrashCount);
+        DEBUG_LOG_P(DEBUG_MODULE_SYSTEM, DEBUG_LEVEL_ERROR, PSTR("[SYSTEM] Watchdog reset in 0x%04X after %lu ms (previous %lu ms, SP 0x%04X)\n"),
+            _systemLastCrash.callback, _systemLastCrash.duration, _systemLastCrash.last, _systemLastCrash.sp);
+    }
+
+    DEBUG_LOG_P(DEBUG_MODULE_SYSTEM, DEBUG_LEVEL_INFO, PSTR("[SYSTEM] Reset reason 0x%02X, %u crashes\n"), _systemMcusr, _systemCrashCount);
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+unsigned char systemResetReason() {
+    return _systemMcusr;
+}
+
+unsigned int systemCrashCount() {
+    return _systemCrashCount;
+}
+
+/**
+ * Context of the stall that caused the last reset, NULL if there was none
+ */
+const system_crash_t * systemCrash() {
+    return _systemCrashed ? &_systemLastCrash : NULL;
+}
+
+#if SYSTEM_STALL_TEST
+
+/**
+ * Blocks the loop, only used to test the watchdog path
+ */
+void systemStall(unsigned long ms) {
+    DEBUG_LOG_P(DEBUG_MODULE_SYSTEM, DEBUG_LEVEL_WARNING, PSTR("[SYSTEM] Stalling for %lu ms\n"), ms);
+    unsigned long start = millis();
+    while (millis() - start < ms);
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void systemSetup() {
+    #ifndef __AVR__
+        // Host build (native tests), no .init3, the test sets MCUSR before setup()
+        _systemMcusr = MCUSR;
+        MCUSR = 0;
+    #endif
+
+    _systemCheckCrash();
+
+    #if SYSTEM_TELEMETRY_INTERVAL
+        DIAG_PORT.begin(DIAG_BAUDRATE);
+        channelAttach(CHANNEL_DIAG, &DIAG_PORT);
+        taskRegister(_systemTelemetry, SYSTEM_TELEMETRY_INTERVAL, TASK_PRIORITY_LOW);
+    #endif
+
+    _systemLoopStart = millis();
+    _systemWatchdogEnable();
+    espurnaRegisterLoop(_systemLoop);
+}
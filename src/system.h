@@ -0,0 +1,70 @@
+/*
+
+SYSTEM HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef SYSTEM_H
+#define SYSTEM_H
+
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include "prototypes.h"
+#include "settings.h"
+#include "debug.h"
+#include "task.h"
+#include "channel.h"
+#include "memory.h"
+
+// Hardware watchdog timeout, WDTO_* value. The first timeout captures the
+// crash context from the watchdog interrupt, the second one resets
+#ifndef SYSTEM_WDT_TIMEOUT
+#define SYSTEM_WDT_TIMEOUT          WDTO_2S
+#endif
+
+// Loop passes longer than this are logged as stalls (ms)
+#ifndef SYSTEM_STALL_TIME
+#define SYSTEM_STALL_TIME           100
+#endif
+
+// Allow the bridge to block the loop on purpose to test the whole path
+#ifndef SYSTEM_STALL_TEST
+#define SYSTEM_STALL_TEST           0
+#endif
+
+// Telemetry stream, on its own port so it never delays the bridge
+#ifndef DIAG_PORT
+#define DIAG_PORT                   Serial2
+#endif
+
+#ifndef DIAG_BAUDRATE
+#define DIAG_BAUDRATE               115200
+#endif
+
+// Telemetry line every these many ms, 0 disables it
+#ifndef SYSTEM_TELEMETRY_INTERVAL
+#define SYSTEM_TELEMETRY_INTERVAL   10000
+#endif
+
+#define SYSTEM_CRASH_MAGIC          0xC7A5
+
+// Kept across the watchdog reset in .noinit RAM
+typedef struct {
+    unsigned int magic;             // SYSTEM_CRASH_MAGIC when captured
+    unsigned int callback;          // Task being run (word address), 0 outside tasks
+    unsigned long duration;         // Time spent in the stalled loop pass (ms)
+    unsigned long last;             // Duration of the previous loop pass (ms)
+    unsigned int sp;                // Stack pointer in the watchdog interrupt
+} system_crash_t;
+
+unsigned char systemResetReason();
+unsigned int systemCrashCount();
+const system_crash_t * systemCrash();
+#if SYSTEM_STALL_TEST
+void systemStall(unsigned long ms);
+#endif
+void systemSetup();
+
+#endif
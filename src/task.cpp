@@ -0,0 +1,146 @@
+/*
+
+TASK MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "task.h"
+
+typedef struct {
+    void (*callback)();         // Task body
+    unsigned long period;       // Run every these many milliseconds
+    unsigned long last;         // Last time it ran
+    unsigned char priority;     // TASK_PRIORITY_*
+    unsigned char events;       // TASK_EVENT_* flags that trigger the task
+} task_t;
+
+task_t _tasks_storage[TASK_MAX];
+Vector<task_t> _tasks(_tasks_storage);
+
+// Set from anywhere (ISRs included), consumed by the loop
+volatile unsigned char _taskEvents = TASK_EVENT_NONE;
+
+// Task being run, read from the watchdog interrupt
+void (* volatile _taskRunning)() = NULL;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+unsigned char _taskTakeEvents() {
+    unsigned char events;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        events = _taskEvents;
+        _taskEvents = TASK_EVENT_NONE;
+    }
+    return events;
+}
+
+bool _taskDue(unsigned char i, unsigned long now, unsigned char events) {
+    if (_tasks[i].events & events) return true;
+    if (_tasks[i].period == TASK_PERIOD_NONE) return false;
+    return (now - _tasks[i].last >= _tasks[i].period);
+}
+
+void _taskIdle() {
+    #if TASK_SLEEP
+        unsigned long now = millis();
+        for (unsigned char i = 0; i < _tasks.size(); i++) {
+            if (_taskDue(i, now, TASK_EVENT_NONE)) return;
+        }
+
+        // Any interrupt wakes us up, the millis() tick included, so the
+        // longest we can oversleep a deadline is a timer0 period (~1ms)
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        cli();
+        if (_taskEvents == TASK_EVENT_NONE) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+    #endif
+}
+
+/**
+ * Runs every due task once, always picking the highest priority one first.
+ * Events flagged while a task runs are seen before the next pick, so a
+ * relay change requested by the link poll is switched before reporting.
+ */
+void _taskLoop() {
+
+    unsigned int done = 0;
+    unsigned char events = TASK_EVENT_NONE;
+
+    while (true) {
+
+        events |= _taskTakeEvents();
+        unsigned long now = millis();
+
+        unsigned char i = 0;
+        for (; i < _tasks.size(); i++) {
+            if (done & (1 << i)) continue;
+            if (_taskDue(i, now, events)) break;
+        }
+        if (i == _tasks.size()) break;
+
+        done |= (1 << i);
+        events &= ~_tasks[i].events;
+        _tasks[i].last = now;
+        _taskRunning = _tasks[i].callback;
+        (_tasks[i].callback)();
+        _taskRunning = NULL;
+
+    }
+
+    // Flags for tasks that already ran this pass are kept for the next one
+    if (events != TASK_EVENT_NONE) taskFlag(events);
+
+    _taskIdle();
+
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+void taskRegister(void (*callback)(), unsigned long period, unsigned char priority, unsigned char events) {
+    if (_tasks.full()) return;
+
+    // Keep the list sorted by priority, registration order within the same priority
+    _tasks.push_back((task_t) { callback, period, millis(), priority, events });
+    for (unsigned char i = _tasks.size() - 1; i > 0; i--) {
+        if (_tasks[i - 1].priority <= _tasks[i].priority) break;
+        task_t task = _tasks[i - 1];
+        _tasks[i - 1] = _tasks[i];
+        _tasks[i] = task;
+    }
+}
+
+void taskRegister(void (*callback)(), unsigned long period, unsigned char priority) {
+    taskRegister(callback, period, priority, TASK_EVENT_NONE);
+}
+
+/**
+ * Callback of the task being run, NULL outside tasks
+ */
+void (* taskRunning())() {
+    return _taskRunning;
+}
+
+void taskFlag(unsigned char events) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _taskEvents |= events;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void taskSetup() {
+    espurnaRegisterLoop(_taskLoop);
+}
@@ -0,0 +1,46 @@
+/*
+
+TASK HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "prototypes.h"
+#include "Vector.h"
+
+// Lower value runs first
+#define TASK_PRIORITY_CRITICAL      0           // Relay switching
+#define TASK_PRIORITY_HIGH          1           // Link polling
+#define TASK_PRIORITY_NORMAL        2
+#define TASK_PRIORITY_LOW           3           // Bulk reporting
+
+// Event flags, a flagged task runs on the next pass regardless of its period
+#define TASK_EVENT_NONE             0x00
+#define TASK_EVENT_RELAY            0x01
+#define TASK_EVENT_BUS              0x02
+#define TASK_EVENT_INPUT            0x04
+
+#define TASK_PERIOD_NONE            0xFFFFFFFFUL    // Only run when flagged
+
+#ifndef TASK_MAX
+#define TASK_MAX                    8           // Maximum number of registered tasks (max 16)
+#endif
+
+#ifndef TASK_SLEEP
+#define TASK_SLEEP                  1           // Put the CPU in idle mode while no task is due
+#endif
+
+void taskRegister(void (*callback)(), unsigned long period, unsigned char priority, unsigned char events);
+void taskRegister(void (*callback)(), unsigned long period, unsigned char priority);
+void taskFlag(unsigned char events);
+void (* taskRunning())();
+void taskSetup();
+
+#endif
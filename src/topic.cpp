@@ -0,0 +1,155 @@
+/*
+
+TOPIC ROUTER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "topic.h"
+
+typedef struct {
+    const char * segment;       // Points into the registered pattern, NULL for a wildcard
+    unsigned char length;       // Segment length
+    unsigned char child;        // First child node or TOPIC_NONE
+    unsigned char next;         // Next sibling node or TOPIC_NONE
+    topic_handler_t handler;    // Set if a pattern ends in this node
+} topic_node_t;
+
+topic_node_t _topicNodes[TOPIC_NODES_MAX];
+unsigned char _topicNodeCount = 0;
+unsigned char _topicRoot = TOPIC_NONE;
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+unsigned char _topicSegmentLength(const char * s) {
+    unsigned char len = 0;
+    while (s[len] != '\0' && s[len] != TOPIC_SEPARATOR) len++;
+    return len;
+}
+
+bool _topicNumber(const char * s, unsigned char len, unsigned int * value) {
+    if (len == 0 || len > 5) return false;
+    unsigned long v = 0;
+    for (unsigned char i = 0; i < len; i++) {
+        if (!isdigit(s[i])) return false;
+        v = v * 10 + (s[i] - '0');
+    }
+    if (v > 0xFFFF) return false;
+    *value = v;
+    return true;
+}
+
+/**
+ * Finds the node for the given segment among the siblings starting
+ * at *head, creating it at the end of the list if not found
+ */
+unsigned char _topicNode(unsigned char * head, const char * segment, unsigned char len) {
+
+    bool wildcard = (len == 1 && segment[0] == TOPIC_WILDCARD);
+
+    unsigned char * link = head;
+    while (*link != TOPIC_NONE) {
+        topic_node_t & node = _topicNodes[*link];
+        if (wildcard) {
+            if (node.segment == NULL) return *link;
+        } else if (node.segment != NULL && node.length == len && strncmp(node.segment, segment, len) == 0) {
+            return *link;
+        }
+        link = &node.next;
+    }
+
+    if (_topicNodeCount >= TOPIC_NODES_MAX) return TOPIC_NONE;
+
+    unsigned char index = _topicNodeCount++;
+    _topicNodes[index] = (topic_node_t) { wildcard ? NULL : segment, len, TOPIC_NONE, TOPIC_NONE, NULL };
+    *link = index;
+    return index;
+}
+
+/**
+ * Walks the trie in place over the topic, literal segments are tried
+ * before wildcards so "relay/all" wins over "relay/+"
+ */
+bool _topicMatch(unsigned char index, const char * topic, unsigned int * args, unsigned char count, const char * payload) {
+
+    unsigned char len = _topicSegmentLength(topic);
+    const char * rest = topic + len;
+    if (*rest == TOPIC_SEPARATOR) rest++;
+    bool last = (topic[len] == '\0');
+
+    for (unsigned char pass = 0; pass < 2; pass++) {
+        for (unsigned char i = index; i != TOPIC_NONE; i = _topicNodes[i].next) {
+            topic_node_t & node = _topicNodes[i];
+
+            if (pass == 0) {
+                if (node.segment == NULL) continue;
+                if (node.length != len || strncmp(node.segment, topic, len) != 0) continue;
+            } else {
+                if (node.segment != NULL) continue;
+                if (count >= TOPIC_WILDCARDS_MAX) continue;
+                if (!_topicNumber(topic, len, &args[count])) continue;
+            }
+
+            unsigned char next_count = count + (pass == 1 ? 1 : 0);
+
+            if (last) {
+                if (node.handler) {
+                    node.handler(args, payload);
+                    return true;
+                }
+            } else if (_topicMatch(node.child, rest, args, next_count, payload)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Compiles the pattern into the routing trie
+ * The pattern is not copied, it must outlive the router (use a literal)
+ */
+bool topicRegister(const char * pattern, topic_handler_t handler) {
+
+    unsigned char * head = &_topicRoot;
+    unsigned char index = TOPIC_NONE;
+    unsigned char wildcards = 0;
+    const char * segment = pattern;
+
+    while (true) {
+        unsigned char len = _topicSegmentLength(segment);
+        if (len == 1 && segment[0] == TOPIC_WILDCARD) wildcards++;
+        if (len == 0 || wildcards > TOPIC_WILDCARDS_MAX) break;
+
+        index = _topicNode(head, segment, len);
+        if (index == TOPIC_NONE) break;
+
+        if (segment[len] == '\0') {
+            _topicNodes[index].handler = handler;
+            return true;
+        }
+
+        head = &_topicNodes[index].child;
+        segment += len + 1;
+    }
+
+    DEBUG_LOG_P(DEBUG_MODULE_MAIN, DEBUG_LEVEL_ERROR, PSTR("[TOPIC] Cannot register %s\n"), pattern);
+    return false;
+}
+
+/**
+ * Routes a topic (already stripped of the device prefix) to its handler
+ * Returns false if no pattern matched
+ */
+bool topicDispatch(const char * topic, const char * payload) {
+    unsigned int args[TOPIC_WILDCARDS_MAX];
+    return _topicMatch(_topicRoot, topic, args, 0, payload);
+}
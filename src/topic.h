@@ -0,0 +1,33 @@
+/*
+
+TOPIC ROUTER HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <Arduino.h>
+#include "debug.h"
+
+#ifndef TOPIC_NODES_MAX
+#define TOPIC_NODES_MAX             16          // Segments across all registered patterns
+#endif
+
+#ifndef TOPIC_WILDCARDS_MAX
+#define TOPIC_WILDCARDS_MAX         2           // Numeric wildcards per pattern
+#endif
+
+#define TOPIC_WILDCARD              '+'         // Matches a single numeric segment
+#define TOPIC_SEPARATOR             '/'
+#define TOPIC_NONE                  0xFF
+
+// args holds the numeric value of each '+' segment, in order
+typedef void (*topic_handler_t)(const unsigned int * args, const char * payload);
+
+bool topicRegister(const char * pattern, topic_handler_t handler);
+bool topicDispatch(const char * topic, const char * payload);
+
+#endif
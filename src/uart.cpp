@@ -7,20 +7,70 @@ Copyright (C) 2019 by Shaeed Khan
 */
 
 #include "uart.h"
+#include "relay.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "system.h"
+#include "accounting.h"
+#include "memory.h"
+#include "config.h"
 
 char _uartBuffer[UART_BUFFER_SIZE];
 bool _uartNewData = false;
 
+// Outbound frames are built in place here, no heap involved
+char _uartTxBuffer[UART_TX_BUFFER_SIZE];
+unsigned char _uartTxLength = 0;
+unsigned char _uartFrameStart = 0;
+bool _uartTxOverflow = false;
+#if !UART_BUS_SUPPORT
+    bool _uartTxStreaming = false;      // Long frame, sent in pieces instead of overflowing
+#endif
+
+#if UART_ACK_SUPPORT
+    unsigned char _uartRxSeq = 0;       // Next sequence number expected from the bridge
+    bool _uartAckPending = false;
+    bool _uartFrameAck = false;         // The frame being built carries the ACK
+    unsigned long _uartAckSince = 0;
+#endif
+
+#if UART_BUS_SUPPORT
+    // Frames are only sent in our turn, right after a frame addressed to us or in our slot after a broadcast
+    unsigned char _uartAddress = UART_BUS_ADDRESS;
+    bool _uartRxBroadcast = false;
+    bool _uartTurnWaiting = false;      // Broadcast seen, our slot has not started yet
+    bool _uartTurnOpen = false;
+    unsigned long _uartTurnStart = 0;
+#endif
+
+// Topics to subscribe on the bridge, sorted and without duplicates
+const char * _uartSubscriptions[UART_SUBSCRIPTIONS_MAX];
+unsigned char _uartSubscriptionCount = 0;
+bool _uartLinkUp = false;
+bool _uartSyncPending = false;          // Relay reports went out, tell the bridge up to which sequence
+
 //Command idetifiers (index 0)
 #define END_STRING_SYMBOL  '~'
 #define START_SUB_MQTT     '1' //Subscribe mqtt topic
 #define START_PUB_MQTT     '2' //Publish the data (received data for bluepill)
 #define START_SETT_GET     '3' //Internel setting/status get
 #define START_SETT_SET     '4' //Internal setting/status set
+#define START_SCENE        '5' //Apply a relay scene, followed by the scene id ('0' + id)
+#define START_CONFIG       '6' //Relay configuration JSON, imported in pieces (reply is the import status), empty asks for the export ('!' on a bus if it does not fit in a turn)
 
 //Settings identifiers (Index 1)
 #define SETT_MQTT_STATUS        '1'
 #define SETT_GET_SUB_LIST       '2' //Request blue pill to send the subscribers list
+#define SETT_DEBUG_MASK         '3' //Debug module mask (hex)
+#define SETT_SCENE              '4' //Scene definition: <'0' + id><target hex> <mask hex>[ <name>], get with <'0' + id>
+#define SETT_TIME               '5' //Local time as a decimal unix timestamp
+#define SETT_SCHEDULE           '6' //Schedule event: <index hex2><minute hex4><relay hex2><action hex2>, index only deletes, <index hex2>! if refused
+#define SETT_RELAY_SYNC         '7' //Relay sequence <epoch>:<seq> in decimal, set by the bridge to get what it missed
+#define SETT_CRASH              '8' //Crash report <count>:<reset reason>[:<task>:<ms>:<previous ms>:<sp>], set stalls the loop for <ms> (test builds)
+#define SETT_ACCOUNTING         '9' //Relay counters from <first hex2>: <first hex2> then 8 bytes hex per relay (on seconds, switches)
+#define SETT_MEMORY             'a' //Memory use <stack max>:<never used>:<heap>:<heap free>:<largest block>:<fragmentation %>, then #<task>:<allocs>:<frees>:<failed> per task
+#define SETT_BAUD               'b' //Set: highest rate the bridge supports, reply is the rate both switch to. Get: <rate>:<malformed>:<overflows>:<dropped commands>:<line errors>
+#define SETT_ACK_WINDOW         'c' //Get: frames in flight allowed, also restarts the sequence numbers at 0
 
 
 //Settings values
@@ -28,6 +78,21 @@ bool _uartNewData = false;
 #define VAL_MQTT_DISCONNECTED  '2'
 
 
+#define UART_BAUD_NEGOTIATION   (!UART_USE_SOFT && !UART_BUS_SUPPORT)
+
+// Link speed and error counters
+unsigned long _uartBaud = UART_BAUDRATE;
+unsigned int _uartMalformed = 0;
+unsigned int _uartOverflows = 0;
+unsigned int _uartLineErrors = 0;       // Framing and overrun errors seen on the USART
+unsigned char _uartWindowErrors = 0;
+unsigned long _uartWindowStart = 0;
+
+#if UART_BAUD_NEGOTIATION
+    const unsigned long _uartBauds[] PROGMEM = { UART_BAUD_RATES };
+    unsigned long _uartBaudSwitch = 0;      // millis() of the last switch, 0 once the bridge was heard
+#endif
+
 #if UART_USE_SOFT
     #include <SoftwareSerial.h>
     SoftwareSerial _uart_mqtt_serial(UART_RX_PIN, UART_TX_PIN, false, UART_BUFFER_SIZE);
@@ -42,25 +107,353 @@ bool _uartNewData = false;
 
 void _receiveUART() {
     static unsigned char ndx = 0;
+    static bool overflow = false;
+    #if UART_BUS_SUPPORT
+        static bool first = true;
+        static bool skip = false;
+    #endif
+
+    #if !UART_USE_SOFT
+        // The core RX interrupt reads UDR right away and the flags go with it,
+        // only a byte still in the USART buffer is caught, a sample is enough
+        // to tell a speed the line cannot hold (same bits on every USART)
+        if (UART_HW_STATUS & (_BV(FE1) | _BV(DOR1))) {
+            _uartLineErrors++;
+            _uartError();
+        }
+    #endif
+
     while (UART_PORT.available() > 0 && _uartNewData == false) {
         char rc = UART_PORT.read();
 
+        #if UART_BUS_SUPPORT
+            // The first byte is the node address, frames for other nodes are skipped unbuffered
+            if (rc == UART_TERMINATION) {
+                first = true;
+                if (skip) {
+                    skip = false;
+                    continue;
+                }
+            } else if (first) {
+                first = false;
+                _uartRxBroadcast = (rc == UART_BUS_BROADCAST);
+                skip = !_uartRxBroadcast && (rc != (char) (UART_BUS_ADDRESS_BASE + _uartAddress));
+                continue;
+            } else if (skip) {
+                continue;
+            }
+        #endif
+
         if (rc != UART_TERMINATION) {
-            _uartBuffer[ndx] = rc;
-            if (ndx < UART_BUFFER_SIZE - 1) ndx++;
+            if (ndx < UART_BUFFER_SIZE - 1) {
+                _uartBuffer[ndx++] = rc;
+            } else {
+                overflow = true;
+            }
         } else {
-            _uartBuffer[ndx] = '\0';
-            _uartNewData = true;
+            // Frames longer than the buffer are discarded, not truncated
+            if (overflow) {
+                DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_WARNING, PSTR("[UART_MQTT] Frame too long, discarded\n"));
+                _uartOverflows++;
+                _uartError();
+            } else {
+                _uartBuffer[ndx] = '\0';
+                _uartNewData = true;
+            }
+            overflow = false;
             ndx = 0;
         }
     }
 }
 
-void _sendOnUart(const char * message) {
-    DEBUG_MSG_P(PSTR("[UART_MQTT] Sending on UART: %s\n"), message);
-    UART_PORT.println(message);
+// -----------------------------------------------------------------------------
+// Frame builder
+// -----------------------------------------------------------------------------
+
+void _uartFrameChar(char c) {
+    // Keep room for the end symbol and the string terminator
+    if (_uartTxLength < UART_TX_BUFFER_SIZE - 2) {
+        _uartTxBuffer[_uartTxLength++] = c;
+    #if !UART_BUS_SUPPORT
+    } else if (_uartTxStreaming) {
+        _uartFlush();
+        _uartFrameStart = 0;
+        _uartTxBuffer[_uartTxLength++] = c;
+    #endif
+    } else {
+        _uartTxOverflow = true;
+    }
+}
+
+void _uartFrameHeader() {
+    _uartFrameStart = _uartTxLength;
+    _uartTxOverflow = false;
+    #if UART_BUS_SUPPORT
+        _uartFrameChar(UART_BUS_ADDRESS_BASE + _uartAddress);
+    #endif
+    #if UART_ACK_SUPPORT
+        _uartFrameAck = _uartAckPending;
+        if (_uartFrameAck) {
+            char hex[3];
+            hexEncode(&_uartRxSeq, 1, hex);
+            _uartFrameChar(UART_ACK_SYMBOL);
+            _uartFrameChar(hex[0]);
+            _uartFrameChar(hex[1]);
+        }
+    #endif
+}
+
+void _uartFrameBegin(char opcode) {
+    _uartFrameHeader();
+    _uartFrameChar(opcode);
+}
+
+void _uartFrameString(const char * s) {
+    while (*s) _uartFrameChar(*s++);
+}
+
+void _uartFrameString_P(PGM_P s) {
+    char c;
+    while ((c = pgm_read_byte(s++))) _uartFrameChar(c);
+}
+
+void _uartFrameNumber(unsigned long n) {
+    char digits[10];
+    unsigned char i = 0;
+    do {
+        digits[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (i > 0) _uartFrameChar(digits[--i]);
+}
+
+void _uartFlush() {
+    if (_uartTxLength == 0) return;
+
+    #if UART_BUS_SUPPORT
+        if (GPIO_NONE != UART_BUS_DE_PIN) digitalWrite(UART_BUS_DE_PIN, HIGH);
+    #endif
+
+    #if UART_CHANNEL
+        // Frames are never dropped, wait for room if needed
+        if (!channelWrite(CHANNEL_BRIDGE, _uartTxBuffer, _uartTxLength)) {
+            channelFlush(CHANNEL_BRIDGE);
+            if (!channelWrite(CHANNEL_BRIDGE, _uartTxBuffer, _uartTxLength)) {
+                UART_PORT.write((const uint8_t *) _uartTxBuffer, _uartTxLength);
+            }
+        }
+    #else
+        UART_PORT.write((const uint8_t *) _uartTxBuffer, _uartTxLength);
+    #endif
+    _uartTxLength = 0;
+
+    #if UART_BUS_SUPPORT
+        // Release the bus only once the last bit is out
+        UART_PORT.flush();
+        if (GPIO_NONE != UART_BUS_DE_PIN) digitalWrite(UART_BUS_DE_PIN, LOW);
+    #endif
+}
+
+#if UART_BUS_SUPPORT
+
+/**
+ * Sends the buffered frames if the bus is ours and they fit in what is left
+ * of the turn, otherwise they wait for the next one
+ */
+void _uartBusSend() {
+    unsigned long now = millis();
+
+    if (_uartTurnWaiting && (now - _uartTurnStart >= (unsigned long) _uartAddress * UART_BUS_SLOT_TIME)) {
+        _uartTurnWaiting = false;
+        _uartTurnOpen = true;
+        _uartTurnStart = now;
+    }
+    if (!_uartTurnOpen || (_uartTxLength == 0)) return;
+
+    // Time on the wire, 10 bits per byte
+    unsigned long needed = ((unsigned long) _uartTxLength * 10000UL + UART_BAUDRATE - 1) / UART_BAUDRATE;
+    if (now - _uartTurnStart + needed + UART_BUS_GUARD_TIME > UART_BUS_SLOT_TIME) {
+        _uartTurnOpen = false;
+        return;
+    }
+    _uartFlush();
+}
+
+#endif
+
+void _uartFrameEnd() {
+    if (_uartTxOverflow) {
+        DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_ERROR, PSTR("[UART_MQTT] Frame too long, dropped\n"));
+        _uartTxLength = _uartFrameStart;
+        return;
+    }
+
+    #if UART_ACK_SUPPORT
+        if (_uartFrameAck) _uartAckPending = false;
+    #endif
+
+    _uartTxBuffer[_uartTxLength++] = END_STRING_SYMBOL;
+    _uartTxBuffer[_uartTxLength] = '\0';
+    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_VERBOSE, PSTR("[UART_MQTT] Sending on UART: %s\n"), _uartTxBuffer + _uartFrameStart);
+    _uartTxBuffer[_uartTxLength++] = UART_TERMINATION;
+
+    // On a shared bus frames wait in the buffer for our turn
+    #if UART_BUS_SUPPORT
+        _uartBusSend();
+    #else
+        _uartFlush();
+    #endif
+}
+
+// -----------------------------------------------------------------------------
+
+void _uartSendConfigStatus(char status) {
+    _uartFrameBegin(START_CONFIG);
+    _uartFrameChar(status);
+    _uartFrameEnd();
 }
 
+/*
+ * The export does not fit in the TX buffer, it is sent as it is written
+ * On a bus it has to wait for our turn like any other frame, so only an
+ * export that fits in the buffer (one slot) goes out, '!' otherwise
+ */
+void _uartSendConfig() {
+    _uartFrameBegin(START_CONFIG);
+    #if UART_BUS_SUPPORT
+        configExport(_uartFrameChar);
+        if (_uartTxOverflow) {
+            _uartFrameEnd();
+            _uartSendConfigStatus(CONFIG_IMPORT_ERROR);
+            return;
+        }
+    #else
+        _uartTxStreaming = true;
+        configExport(_uartFrameChar);
+        _uartTxStreaming = false;
+    #endif
+    _uartFrameEnd();
+}
+
+// -----------------------------------------------------------------------------
+// Link speed
+// -----------------------------------------------------------------------------
+
+void _uartBegin(unsigned long baud) {
+    #if UART_CHANNEL
+        channelFlush(CHANNEL_BRIDGE);
+    #endif
+    UART_PORT.flush();
+    UART_PORT.end();
+    UART_PORT.begin(baud);
+    _uartBaud = baud;
+    _uartWindowErrors = 0;
+    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_INFO, PSTR("[UART_MQTT] Link at %lu baud\n"), baud);
+}
+
+void _uartSendBaud(unsigned long baud) {
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_BAUD);
+    _uartFrameNumber(baud);
+    _uartFrameEnd();
+}
+
+#if UART_BAUD_NEGOTIATION
+
+/*
+ * Tells the bridge the new rate at the current one and switches,
+ * both ends go back to UART_BAUDRATE if nothing is heard afterwards
+ */
+void _uartBaudSwitchTo(unsigned long baud) {
+    _uartSendBaud(baud);
+    if (baud == _uartBaud) return;
+    _uartBegin(baud);
+    _uartBaudSwitch = millis();
+    if (_uartBaudSwitch == 0) _uartBaudSwitch = 1;
+}
+
+// Highest rate not above max, UART_BAUDRATE if none
+unsigned long _uartBaudBest(unsigned long max) {
+    for (unsigned char i = 0; i < sizeof(_uartBauds) / sizeof(_uartBauds[0]); i++) {
+        unsigned long baud = pgm_read_dword(&_uartBauds[i]);
+        if (baud <= max && baud > UART_BAUDRATE) return baud;
+    }
+    return UART_BAUDRATE;
+}
+
+void _uartBaudCheck() {
+    if (_uartBaudSwitch == 0) return;
+    if (millis() - _uartBaudSwitch < UART_BAUD_TIMEOUT) return;
+    _uartBaudSwitch = 0;
+    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_WARNING, PSTR("[UART_MQTT] Nothing heard at %lu baud\n"), _uartBaud);
+    _uartBegin(UART_BAUDRATE);
+}
+
+#endif // UART_BAUD_NEGOTIATION
+
+/*
+ * Counts a bad frame or line error, too many of them in a window step the link down
+ */
+void _uartError() {
+    unsigned long now = millis();
+    if (now - _uartWindowStart > UART_ERROR_WINDOW) {
+        _uartWindowStart = now;
+        _uartWindowErrors = 0;
+    }
+    if (++_uartWindowErrors < UART_ERROR_THRESHOLD) return;
+    _uartWindowErrors = 0;
+
+    #if UART_BAUD_NEGOTIATION
+        if (_uartBaud > UART_BAUDRATE) {
+            DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_WARNING, PSTR("[UART_MQTT] Too many errors at %lu baud\n"), _uartBaud);
+            _uartBaudSwitchTo(_uartBaudBest(_uartBaud - 1));
+        }
+    #endif
+}
+
+void _settingsBaud(char * data) {
+    #if UART_BAUD_NEGOTIATION
+        _uartBaudSwitchTo(_uartBaudBest(strtoul(data, NULL, 10)));
+    #else
+        // Fixed speed
+        _uartSendBaud(_uartBaud);
+    #endif
+}
+
+// -----------------------------------------------------------------------------
+
+#if UART_ACK_SUPPORT
+
+// -----------------------------------------------------------------------------
+// Acknowledgements
+// -----------------------------------------------------------------------------
+
+/*
+ * Go-back-N receiver: only the expected frame is processed, anything else
+ * is dropped and the bridge resends from the acknowledged number
+ */
+bool _uartSequence(const char * data) {
+    unsigned char seq;
+    if (hexDecode(data, &seq, 1) != 1) return false;
+
+    if (!_uartAckPending) _uartAckSince = millis();
+    _uartAckPending = true;
+
+    if (seq != _uartRxSeq) {
+        DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_VERBOSE, PSTR("[UART_MQTT] Got #%d, expecting #%d\n"), seq, _uartRxSeq);
+        return false;
+    }
+    _uartRxSeq++;
+    return true;
+}
+
+void _uartSendAck() {
+    _uartFrameHeader();
+    _uartFrameEnd();
+}
+
+#endif // UART_ACK_SUPPORT
+
 int16_t getEnd(const char * data) {
     uint16_t i = 0;
     while(i < UART_BUFFER_SIZE && data[i] != END_STRING_SYMBOL && data[i] != '\0') {
@@ -81,12 +474,34 @@ void _uartProcess() {
     char * data = _uartBuffer;
     int16_t end = getEnd(data);
 
+    //Mark data used, malformed frames are dropped as well
+    _uartNewData = false;
+
+    if (end <= 0) {
+        _uartMalformed++;
+        _uartError();
+        return;
+    }
+
+    #if UART_BAUD_NEGOTIATION
+        // The bridge made it to the new speed
+        _uartBaudSwitch = 0;
+    #endif
+
     //Check if data processing required
     if(end > 0) {
         char * topic = NULL;
         char * msg = NULL;
         //Delete the end character
         data[end] = '\0';
+
+        #if UART_ACK_SUPPORT
+            if (data[0] == UART_SEQ_SYMBOL) {
+                if (!_uartSequence(data + 1)) return;
+                data += 3;
+            }
+        #endif
+
         //Delete the first character
         data += 1;
 
@@ -97,13 +512,18 @@ void _uartProcess() {
                 break;
 
             case START_PUB_MQTT:
-                topic = strchr(data + 1, ' '); //Search the first space
+                topic = strchr(data, ' '); //Search the first space
+                if (topic == NULL || topic == data) {
+                    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_WARNING, PSTR("[UART_MQTT] Malformed publish frame\n"));
+                    break;
+                }
                 msg = topic + 1;
                 //Mark the topic end and initialize topic to start of topic
                 *topic = '\0';
                 topic = data;
-                //mqttSend(topic, msg);
-                //DEBUG_MSG_P(PSTR("[UART_MQTT] Send data over MQTT: %s %s\n"), topic, msg);
+                if (!topicDispatch(topic, msg)) {
+                    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_VERBOSE, PSTR("[UART_MQTT] No route for %s\n"), topic);
+                }
                 break;
 
             case START_SETT_GET:
@@ -111,17 +531,157 @@ void _uartProcess() {
                 break;
 
             case START_SETT_SET:
-                //_settingsSet(data);
+                _settingsSet(data);
+                break;
+
+            case START_SCENE:
+                sceneApply(data[0] - '0');
+                break;
+
+            case START_CONFIG:
+                if (data[0] == '\0') {
+                    _uartSendConfig();
+                } else {
+                    _uartSendConfigStatus(configImport(data));
+                }
                 break;
         
             default:
                 break;
         }
+    }
+
+}
+
+// -----------------------------------------------------------------------------
+// Subscriptions
+// -----------------------------------------------------------------------------
+
+/*
+ * Sends every registered topic space separated in a single frame,
+ * more frames are only used if the list does not fit in the TX buffer
+ */
+void _uartSendSubscriptions() {
+    if (_uartSubscriptionCount == 0) return;
+
+    _uartFrameBegin(START_SUB_MQTT);
+    for (unsigned char i = 0; i < _uartSubscriptionCount; i++) {
+        const char * topic = _uartSubscriptions[i];
+        if (i > 0) {
+            if (_uartTxLength + 1 + strlen(topic) > UART_TX_BUFFER_SIZE - 2) {
+                _uartFrameEnd();
+                _uartFrameBegin(START_SUB_MQTT);
+            } else {
+                _uartFrameChar(' ');
+            }
+        }
+        _uartFrameString(topic);
+    }
+    _uartFrameEnd();
+}
 
-        //Mark data used
-        _uartNewData = false;
+void _uartSendCrash() {
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_CRASH);
+    _uartFrameNumber(systemCrashCount());
+    _uartFrameChar(':');
+    _uartFrameNumber(systemResetReason());
+    const system_crash_t * crash = systemCrash();
+    if (crash) {
+        _uartFrameChar(':');
+        _uartFrameNumber(crash->callback);
+        _uartFrameChar(':');
+        _uartFrameNumber(crash->duration);
+        _uartFrameChar(':');
+        _uartFrameNumber(crash->last);
+        _uartFrameChar(':');
+        _uartFrameNumber(crash->sp);
     }
+    _uartFrameEnd();
+}
 
+/*
+ * Sends the counters of as many relays as fit in one frame, starting at first
+ * The bridge asks again from where the frame ended, an empty frame is the end
+ */
+void _uartSendAccounting(unsigned char first) {
+    unsigned char record[ACCOUNTING_RECORD_SIZE];
+    char hex[2 * ACCOUNTING_RECORD_SIZE + 1];
+
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_ACCOUNTING);
+    hexEncode(&first, 1, hex);
+    _uartFrameString(hex);
+
+    for (unsigned char id = first; id < relayCount(); id++) {
+        if (_uartTxLength + 2 * ACCOUNTING_RECORD_SIZE > UART_TX_BUFFER_SIZE - 2) break;
+        accountingRecord(id, record);
+        hexEncode(record, ACCOUNTING_RECORD_SIZE, hex);
+        _uartFrameString(hex);
+    }
+    _uartFrameEnd();
+}
+
+void _uartSendMemory() {
+    memory_stats_t stats;
+    memoryStats(&stats);
+
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_MEMORY);
+    _uartFrameNumber(stats.stack_max);
+    _uartFrameChar(':');
+    _uartFrameNumber(stats.unused);
+    _uartFrameChar(':');
+    _uartFrameNumber(stats.heap_size);
+    _uartFrameChar(':');
+    _uartFrameNumber(stats.heap_free);
+    _uartFrameChar(':');
+    _uartFrameNumber(stats.largest);
+    _uartFrameChar(':');
+    _uartFrameNumber(stats.fragmentation);
+    _uartFrameEnd();
+
+    // Allocation counters, only with MEMORY_ALLOC_TRACKING
+    for (unsigned char i = 0; i < memoryOwners(); i++) {
+        const memory_owner_t * owner = memoryOwner(i);
+        _uartFrameBegin(START_SETT_SET);
+        _uartFrameChar(SETT_MEMORY);
+        _uartFrameChar('#');
+        _uartFrameNumber((unsigned int) (uintptr_t) owner->owner);
+        _uartFrameChar(':');
+        _uartFrameNumber(owner->allocs);
+        _uartFrameChar(':');
+        _uartFrameNumber(owner->frees);
+        _uartFrameChar(':');
+        _uartFrameNumber(owner->failed);
+        _uartFrameEnd();
+    }
+}
+
+/*
+ * Same format the bridge uses to define the scene
+ */
+void _uartSendScene(unsigned char id) {
+    unsigned char target[RELAY_BYTES];
+    unsigned char mask[RELAY_BYTES];
+    if (!sceneGet(id, target, mask)) return;
+
+    char hex[2 * RELAY_BYTES + 1];
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_SCENE);
+    _uartFrameChar('0' + id);
+    hexEncode(target, RELAY_BYTES, hex);
+    _uartFrameString(hex);
+    _uartFrameChar(' ');
+    hexEncode(mask, RELAY_BYTES, hex);
+    _uartFrameString(hex);
+
+    String name = sceneName(id);
+    if (name.length() > 0) {
+        _uartFrameChar(' ');
+        _uartFrameString(name.c_str());
+    }
+    _uartFrameEnd();
 }
 
 void _settingsGet(char * data) {
@@ -130,12 +690,170 @@ void _settingsGet(char * data) {
         case SETT_MQTT_STATUS:
             _sendMqttStatusToBluePill();
             break;
+
+        case SETT_GET_SUB_LIST:
+            _uartSendSubscriptions();
+            break;
+
+        case SETT_SCENE:
+            _uartSendScene(data[1] - '0');
+            break;
+
+        case SETT_CRASH:
+            _uartSendCrash();
+            break;
+
+        case SETT_MEMORY:
+            _uartSendMemory();
+            break;
+
+        case SETT_ACK_WINDOW:
+            #if UART_ACK_SUPPORT
+                _uartRxSeq = 0;
+            #endif
+            _uartFrameBegin(START_SETT_SET);
+            _uartFrameChar(SETT_ACK_WINDOW);
+            _uartFrameNumber(UART_ACK_SUPPORT ? UART_ACK_WINDOW : 0);
+            _uartFrameEnd();
+            break;
+
+        case SETT_BAUD:
+            _uartFrameBegin(START_SETT_SET);
+            _uartFrameChar(SETT_BAUD);
+            _uartFrameNumber(_uartBaud);
+            _uartFrameChar(':');
+            _uartFrameNumber(_uartMalformed);
+            _uartFrameChar(':');
+            _uartFrameNumber(_uartOverflows);
+            _uartFrameChar(':');
+            _uartFrameNumber(relayCommandsDropped());
+            _uartFrameChar(':');
+            _uartFrameNumber(_uartLineErrors);
+            _uartFrameEnd();
+            break;
+
+        case SETT_ACCOUNTING: {
+            unsigned char first = 0;
+            hexDecode(data + 1, &first, 1);
+            _uartSendAccounting(first);
+            break;
+        }
     
         default:
             break;
     }
 }
 
+void _settingsScene(char * data) {
+    if (data[0] == '\0') return;
+    unsigned char id = data[0] - '0';
+
+    unsigned char target[RELAY_BYTES] = {0};
+    unsigned char mask[RELAY_BYTES] = {0};
+    hexDecode(data + 1, target, RELAY_BYTES);
+
+    char * p = strchr(data + 1, ' ');
+    if (p == NULL) return;
+    hexDecode(p + 1, mask, RELAY_BYTES);
+
+    char * name = strchr(p + 1, ' ');
+    sceneSave(id, target, mask, name ? name + 1 : NULL);
+}
+
+void _settingsSchedule(char * data) {
+    unsigned char index;
+    if (hexDecode(data, &index, 1) != 1) return;
+    if (data[2] == '\0') {
+        schedulerDelete(index);
+        return;
+    }
+
+    char * end;
+    unsigned long packed = strtoul(data + 2, &end, 16);
+    if ((*end == '\0') && (end - data <= 10) && schedulerSave(index, packed)) return;
+
+    // Nothing stored, the bridge is told which one
+    DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_WARNING, PSTR("[UART_MQTT] Wrong schedule event (%s)\n"), data);
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_SCHEDULE);
+    _uartFrameChar(data[0]);
+    _uartFrameChar(data[1]);
+    _uartFrameChar('!');
+    _uartFrameEnd();
+}
+
+void _settingsRelaySync(char * data) {
+    char * p;
+    unsigned int epoch = strtoul(data, &p, 10);
+    if (*p != ':') return;
+    relayResync(epoch, strtoul(p + 1, NULL, 10));
+
+    // The replayed changes are still queued, the sequence goes out behind them
+    eventPublish(EVENT_RELAY_SYNC);
+}
+
+void _uartSendSync() {
+    _uartSyncPending = false;
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_RELAY_SYNC);
+    _uartFrameNumber(relayEpoch());
+    _uartFrameChar(':');
+    _uartFrameNumber(relaySequence());
+    _uartFrameEnd();
+}
+
+void _settingsSet(char * data) {
+
+    switch (data[0]) {
+        case SETT_MQTT_STATUS:
+            if (data[1] == VAL_MQTT_CONNECTED) {
+                _uartLinkUp = true;
+                _uartSendSubscriptions();
+                // Stalls are reported without being asked
+                if (systemCrash()) _uartSendCrash();
+                eventPublish(EVENT_LINK_UP);
+            }
+            if (data[1] == VAL_MQTT_DISCONNECTED) {
+                _uartLinkUp = false;
+                eventPublish(EVENT_LINK_DOWN);
+            }
+            break;
+
+        case SETT_DEBUG_MASK:
+            debugSetMask(strtoul(data + 1, NULL, 16));
+            break;
+
+        case SETT_SCENE:
+            _settingsScene(data + 1);
+            break;
+
+        case SETT_TIME:
+            schedulerSetTime(strtoul(data + 1, NULL, 10));
+            break;
+
+        case SETT_SCHEDULE:
+            _settingsSchedule(data + 1);
+            break;
+
+        case SETT_RELAY_SYNC:
+            _settingsRelaySync(data + 1);
+            break;
+
+        #if SYSTEM_STALL_TEST
+            case SETT_CRASH:
+                systemStall(strtoul(data + 1, NULL, 10));
+                break;
+        #endif
+
+        case SETT_BAUD:
+            _settingsBaud(data + 1);
+            break;
+
+        default:
+            break;
+    }
+}
+
 void _sendMqttStatusToBluePill() {
     //_sendMqttStatusToBluePill(isMqttConnected());
 }
@@ -144,63 +862,159 @@ void _sendMqttStatusToBluePill() {
  * True- Connected, False- Disconnected
  */ 
 void _sendMqttStatusToBluePill(bool status) {
-    char mqttStatus = status ? VAL_MQTT_CONNECTED : VAL_MQTT_DISCONNECTED;
-    char * data = new char[5];
-    sprintf(data, "%c%c%c%c", START_SETT_SET, SETT_MQTT_STATUS, mqttStatus, END_STRING_SYMBOL);
-    _sendOnUart(data);
-
-    delete data;
+    _uartFrameBegin(START_SETT_SET);
+    _uartFrameChar(SETT_MQTT_STATUS);
+    _uartFrameChar(status ? VAL_MQTT_CONNECTED : VAL_MQTT_DISCONNECTED);
+    _uartFrameEnd();
 }
 
 void _requestBluePillToSubscribe(){
-    char * data = new char[5];
-    sprintf(data, "%c%c%c", START_SETT_GET, SETT_GET_SUB_LIST, END_STRING_SYMBOL);
-    _sendOnUart(data);
-
-    delete data;
+    _uartFrameBegin(START_SETT_GET);
+    _uartFrameChar(SETT_GET_SUB_LIST);
+    _uartFrameEnd();
 }
 
-char * _toCharArray(String str) {
-    int len = str.length();
-    char * charr = new char[len + 1];
-    str.toCharArray(charr, len+1);
+// -----------------------------------------------------------------------------
+// SETUP & LOOP
+// -----------------------------------------------------------------------------
 
-    return charr;
-}
+void _uartEventCallback(const event_t & event) {
 
-void _processMqtt(const char * topic, const char * msg) {
-    //Remove the esp8266 id from the topic
-    /*String topicMag = mqttMagnitude((char *)topic);
-    char * topicMagArr = _toCharArray(topicMag);
+    if (event.type == EVENT_RELAY_CHANGED) {
+        _uartFrameBegin(START_PUB_MQTT);
+        _uartFrameString_P(PSTR(MQTT_TOPIC_RELAY "/"));
+        _uartFrameNumber(event.id);
+        _uartFrameChar(' ');
+        _uartFrameString_P(event.value ? PSTR(RELAY_MQTT_ON) : PSTR(RELAY_MQTT_OFF));
+        _uartFrameEnd();
+    }
 
-    size_t lenT = strlen(topicMagArr);
-    size_t lenM = strlen(msg);
-    char * data = new char[lenT + lenM + 5];
-    
-    //Copy data
-    sprintf(data, "%c%s %s%c", START_PUB_MQTT, topicMagArr, msg, END_STRING_SYMBOL);
-    _sendOnUart(data);
+    if (event.type == EVENT_RELAY_BITMAP) {
+        unsigned char bitmap[RELAY_BYTES] = {0};
+        unsigned char count = relayCount();
+        for (unsigned char id = 0; id < count; id++) {
+            if (relayStatus(id)) bitmap[id >> 3] |= (1 << (id & 7));
+        }
+        char hex[2 * RELAY_BYTES + 1];
+        hexEncode(bitmap, (count + 7) / 8, hex);
+
+        _uartFrameBegin(START_PUB_MQTT);
+        _uartFrameString_P(PSTR(MQTT_TOPIC_RELAY "/all "));
+        _uartFrameString(hex);
+        _uartFrameEnd();
+    }
 
-    delete topicMagArr;
-    delete data;*/
+    _uartSyncPending = true;
 }
 
 // -----------------------------------------------------------------------------
-// SETUP & LOOP
+// Public
 // -----------------------------------------------------------------------------
 
+/*
+ * Adds the topic to the subscriptions sent each time the bridge connects
+ * The topic is not copied, it must outlive the registry (use a literal)
+ */
+bool uartmqttSubscribe(const char * topic) {
+
+    // Binary search for the insertion point
+    unsigned char low = 0;
+    unsigned char high = _uartSubscriptionCount;
+    while (low < high) {
+        unsigned char mid = (low + high) / 2;
+        int cmp = strcmp(_uartSubscriptions[mid], topic);
+        if (cmp == 0) return true;
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (_uartSubscriptionCount >= UART_SUBSCRIPTIONS_MAX) {
+        DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_ERROR, PSTR("[UART_MQTT] Cannot subscribe to %s\n"), topic);
+        return false;
+    }
+
+    for (unsigned char i = _uartSubscriptionCount; i > low; i--) {
+        _uartSubscriptions[i] = _uartSubscriptions[i - 1];
+    }
+    _uartSubscriptions[low] = topic;
+    _uartSubscriptionCount++;
+
+    // Late registrations go out on their own
+    if (_uartLinkUp) {
+        _uartFrameBegin(START_SUB_MQTT);
+        _uartFrameString(topic);
+        _uartFrameEnd();
+    }
+
+    return true;
+}
+
+void uartmqttSend(const char * topic, const char * payload) {
+    _uartFrameBegin(START_PUB_MQTT);
+    _uartFrameString(topic);
+    _uartFrameChar(' ');
+    _uartFrameString(payload);
+    _uartFrameEnd();
+}
+
 void _uartmqttLoop() {
-    _receiveUART();
-    _uartProcess();
-    _sendOnMqtt(_uartBuffer);
+    // Drain several frames per run, but do not hog the loop
+    for (unsigned char i = 0; i < UART_FRAMES_PER_POLL; i++) {
+        _receiveUART();
+        if (!_uartNewData) break;
+        _uartProcess();
+
+        #if UART_BUS_SUPPORT
+            // Every node answers a broadcast in its own slot, an addressed frame
+            // gives us the bus right away, replies raised later by the events
+            // go out as soon as they are built while the turn lasts
+            _uartTurnWaiting = _uartRxBroadcast;
+            _uartTurnOpen = !_uartRxBroadcast;
+            _uartTurnStart = millis();
+            _uartBusSend();
+        #endif
+    }
+
+    #if UART_BAUD_NEGOTIATION
+        _uartBaudCheck();
+    #endif
+
+    #if UART_ACK_SUPPORT
+        // Nothing went out to carry the ACK
+        if (_uartAckPending && (millis() - _uartAckSince >= UART_ACK_DELAY)) _uartSendAck();
+    #endif
+
+    // One sequence frame after a batch of relay reports
+    if (_uartSyncPending && _uartLinkUp) _uartSendSync();
+
+    #if UART_BUS_SUPPORT
+        _uartBusSend();
+    #endif
 }
 
 void uartmqttSetup() {
-    // Init port
-	// Commented as using the default serial which will be enable by main.cpp
-    //UART_MQTT_PORT.begin(UART_MQTT_BAUDRATE);
+    // Init port, always at the fallback speed, faster ones are negotiated
+    UART_PORT.begin(UART_BAUDRATE);
+    #if UART_CHANNEL
+        channelAttach(CHANNEL_BRIDGE, &UART_PORT);
+    #endif
+
+    #if UART_BUS_SUPPORT
+        _uartAddress = getSetting(K_BUS_ADDRESS, UART_BUS_ADDRESS).toInt();
+        if (GPIO_NONE != UART_BUS_DE_PIN) {
+            pinMode(UART_BUS_DE_PIN, OUTPUT);
+            digitalWrite(UART_BUS_DE_PIN, LOW);
+        }
+        DEBUG_LOG_P(DEBUG_MODULE_UART, DEBUG_LEVEL_INFO, PSTR("[UART_MQTT] Bus node address %d\n"), _uartAddress);
+    #endif
+
+    eventSubscribe(EVENT_RELAY_CHANGED, _uartEventCallback);
+    eventSubscribe(EVENT_RELAY_BITMAP, _uartEventCallback);
+    eventSubscribe(EVENT_RELAY_SYNC, _uartEventCallback);
 
-    // Register loop
-    //Called in main
-    espurnaRegisterLoop(_uartmqttLoop);
+    // Register task
+    taskRegister(_uartmqttLoop, UART_POLL_INTERVAL, TASK_PRIORITY_HIGH);
 }
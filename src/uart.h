@@ -12,13 +12,21 @@ Copyright (C) 2019 by Shaeed Khan
 #include <Arduino.h>
 #include <string.h>
 #include "debug.h"
+#include "task.h"
+#include "event.h"
+#include "topic.h"
+#include "channel.h"
 
 #ifndef UART_USE_SOFT
 #define UART_USE_SOFT          0           // Use SoftwareSerial
 #endif
 
 #ifndef UART_HW_PORT
-#define UART_HW_PORT           Serial      // Hardware serial port (if UART_MQTT_USE_SOFT == 0)
+#define UART_HW_PORT           Serial1     // Hardware serial port (if UART_MQTT_USE_SOFT == 0), Serial is for debug
+#endif
+
+#ifndef UART_HW_STATUS
+#define UART_HW_STATUS         UCSR1A      // Status register of UART_HW_PORT, its framing and overrun flags count as errors
 #endif
 
 #ifndef UART_RX_PIN
@@ -29,25 +37,123 @@ Copyright (C) 2019 by Shaeed Khan
 #define UART_TX_PIN            5           // TX PIN (if UART_MQTT_USE_SOFT == 1)
 #endif
 
+// Frames go through the bridge channel, except for SoftwareSerial and the bus
+// mode that has to know when the last bit is out
+#define UART_CHANNEL           (!UART_USE_SOFT && !UART_BUS_SUPPORT)
+
 #ifndef UART_BAUDRATE
-#define UART_BAUDRATE          115200      // Serial speed
+#define UART_BAUDRATE          115200      // Serial speed at boot and fallback speed
+#endif
+
+// Faster rates the bridge can ask for, highest first, all with 0% error at 16MHz
+// Only with a hardware port and not in bus mode
+#ifndef UART_BAUD_RATES
+#define UART_BAUD_RATES        1000000, 500000, 250000
+#endif
+
+#ifndef UART_BAUD_TIMEOUT
+#define UART_BAUD_TIMEOUT      1000        // Back to UART_BAUDRATE if no frame arrives this long after a switch (ms)
+#endif
+
+// Sequenced frames: the bridge may prefix a frame with UART_SEQ_SYMBOL and a hex2 sequence number
+// Frames are accepted in order only (go-back-N), the next expected number is acknowledged
+// cumulatively with UART_ACK_SYMBOL and hex2, piggybacked on the next outbound frame
+#ifndef UART_ACK_SUPPORT
+#define UART_ACK_SUPPORT       1
+#endif
+
+#ifndef UART_ACK_WINDOW
+#define UART_ACK_WINDOW        4           // Frames the bridge may have in flight, advertised with SETT 'c' (max 127)
+#endif
+
+#ifndef UART_ACK_DELAY
+#define UART_ACK_DELAY         5           // Wait this long for an outbound frame before sending a bare ACK (ms)
+#endif
+
+#define UART_SEQ_SYMBOL        '#'
+#define UART_ACK_SYMBOL        '@'
+
+#ifndef UART_ERROR_THRESHOLD
+#define UART_ERROR_THRESHOLD   8           // Bad frames and line errors within UART_ERROR_WINDOW that make us step down
+#endif
+
+#ifndef UART_ERROR_WINDOW
+#define UART_ERROR_WINDOW      10000       // ms
 #endif
 
 #ifndef UART_TERMINATION
 #define UART_TERMINATION      '\n'         // Termination character
 #endif
 
+// Addressed bus mode, several controllers share one half-duplex link (RS-485 style)
+// Every frame starts with the node address, nodes only talk in their turn: for
+// UART_BUS_SLOT_TIME ms right after a frame addressed to them or, after a broadcast,
+// starting at address * UART_BUS_SLOT_TIME ms
+#ifndef UART_BUS_SUPPORT
+#define UART_BUS_SUPPORT       0
+#endif
+
+#ifndef UART_BUS_ADDRESS
+#define UART_BUS_ADDRESS       0           // Default node address, overridden by the K_BUS_ADDRESS setting
+#endif
+
+#ifndef UART_BUS_ADDRESS_BASE
+#define UART_BUS_ADDRESS_BASE  'A'         // Address byte is UART_BUS_ADDRESS_BASE + address
+#endif
+
+#ifndef UART_BUS_BROADCAST
+#define UART_BUS_BROADCAST     '*'         // Address byte for frames meant for every node
+#endif
+
+#ifndef UART_BUS_GUARD_TIME
+#define UART_BUS_GUARD_TIME    2           // Slack at the end of a slot for the loop latency and the transceiver turnaround (ms)
+#endif
+
+#ifndef UART_BUS_DE_PIN
+#define UART_BUS_DE_PIN        GPIO_NONE   // Transceiver driver enable pin
+#endif
+
 #define UART_BUFFER_SIZE       200         // UART buffer size
 
+#ifndef UART_TX_BUFFER_SIZE
+#if UART_BUS_SUPPORT
+#define UART_TX_BUFFER_SIZE    128         // Outbound frames held until our turn on the bus (max 255)
+#else
+#define UART_TX_BUFFER_SIZE    64          // Outbound frame buffer size (max 255)
+#endif
+#endif
+
+// Response slot length in ms, long enough for a full TX buffer (10 bits per byte), 14ms at 115200
+#ifndef UART_BUS_SLOT_TIME
+#define UART_BUS_SLOT_TIME     ((UART_TX_BUFFER_SIZE * 10000UL + UART_BAUDRATE - 1) / UART_BAUDRATE + UART_BUS_GUARD_TIME)
+#endif
+
+#ifndef UART_FRAMES_PER_POLL
+#define UART_FRAMES_PER_POLL   4           // Frames processed per poll at most
+#endif
+
+#ifndef UART_SUBSCRIPTIONS_MAX
+#define UART_SUBSCRIPTIONS_MAX 8           // Topics registered with uartmqttSubscribe
+#endif
+
+#ifndef UART_POLL_INTERVAL
+#define UART_POLL_INTERVAL     1           // Poll the port every these many ms (64 byte RX buffer lasts ~5ms at 115200)
+#endif
+
 void _receiveUART();
-void _sendOnMqtt(const char * data);
-void _sendOnUart(const char * message);
+void _uartProcess();
 void _uartmqttLoop();
+void _uartFlush();
+void _uartError();
+bool uartmqttSubscribe(const char * topic);
+void uartmqttSend(const char * topic, const char * payload);
 void uartmqttSetup();
-//char * _toCharArray(String str);
 void _sendMqttStatusToBluePill();
 void _sendMqttStatusToBluePill(bool status);
 void _settingsGet(char * data);
-//void _settingsSet(char * data);
+void _settingsSet(char * data);
+void _settingsScene(char * data);
+void _settingsSchedule(char * data);
+void _settingsRelaySync(char * data);
 
 #endif
\ No newline at end of file
@@ -46,6 +46,33 @@ bool isNumber(const char * s) {
     return digit;
 }
 
+/**
+ * Decodes up to size bytes from a hex string, stopping at the first non hex char
+ * Bytes not present in the string are left untouched
+ * Returns the number of bytes decoded
+ */
+unsigned char hexDecode(const char * in, unsigned char * out, unsigned char size) {
+    unsigned char count = 0;
+    while (count < size && isxdigit(in[0]) && isxdigit(in[1])) {
+        char byte[3] = { in[0], in[1], '\0' };
+        out[count++] = strtoul(byte, NULL, 16);
+        in += 2;
+    }
+    return count;
+}
+
+/**
+ * Encodes size bytes as hex, out must hold 2 * size + 1 chars
+ */
+void hexEncode(const unsigned char * in, unsigned char size, char * out) {
+    static const char digits[] PROGMEM = "0123456789ABCDEF";
+    for (unsigned char i = 0; i < size; i++) {
+        *out++ = pgm_read_byte(&digits[in[i] >> 4]);
+        *out++ = pgm_read_byte(&digits[in[i] & 0x0F]);
+    }
+    *out = '\0';
+}
+
 void nice_delay(unsigned long ms) {
     unsigned long start = millis();
     while (millis() - start < ms) delay(1);
@@ -14,5 +14,7 @@ Copyright (C) 2019 by Shaeed Khan
 char * ltrim(char * s);
 void nice_delay(unsigned long ms);
 bool isNumber(const char * s);
+unsigned char hexDecode(const char * in, unsigned char * out, unsigned char size);
+void hexEncode(const unsigned char * in, unsigned char size, char * out);
 
 #endif
\ No newline at end of file
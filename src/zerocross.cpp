@@ -0,0 +1,164 @@
+/*
+
+ZERO CROSS MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#include "zerocross.h"
+
+#if ZEROCROSS_SUPPORT
+
+typedef struct {
+    volatile uint8_t * port;    // Output register
+    uint8_t set;                // Bits to drive HIGH
+    uint8_t clear;              // Bits to drive LOW
+} zerocross_port_t;
+
+// Built by the relay loop
+zerocross_port_t _zerocrossPending[ZEROCROSS_PORTS_MAX];
+unsigned char _zerocrossPendingCount = 0;
+
+// Waiting for the crossing, only touched with interrupts off
+zerocross_port_t _zerocrossArmed[ZEROCROSS_PORTS_MAX];
+volatile unsigned char _zerocrossArmedCount = 0;
+
+volatile unsigned long _zerocrossLast = 0;      // micros() of the last crossing
+volatile unsigned long _zerocrossPeriod = 0;    // Between the last two crossings
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+// Interrupts off
+void _zerocrossApply() {
+    for (unsigned char i = 0; i < _zerocrossArmedCount; i++) {
+        *_zerocrossArmed[i].port = (*_zerocrossArmed[i].port & ~_zerocrossArmed[i].clear) | _zerocrossArmed[i].set;
+    }
+    _zerocrossArmedCount = 0;
+}
+
+void _zerocrossCrossing() {
+    unsigned long now = micros();
+    _zerocrossPeriod = now - _zerocrossLast;
+    _zerocrossLast = now;
+
+    if (_zerocrossArmedCount == 0) return;
+
+    #if ZEROCROSS_OFFSET == 0
+        _zerocrossApply();
+    #else
+        // Already counting from an earlier crossing, offsets longer than
+        // the half period would never fire if every crossing restarted it
+        if (TIMSK1 & _BV(OCIE1A)) return;
+
+        // Timer1 at 2MHz, one shot
+        TCNT1 = 0;
+        OCR1A = 2 * ZEROCROSS_OFFSET;
+        TIFR1 = _BV(OCF1A);
+        TIMSK1 = _BV(OCIE1A);
+        TCCR1B = _BV(WGM12) | _BV(CS11);
+    #endif
+}
+
+#if ZEROCROSS_OFFSET > 0
+ISR(TIMER1_COMPA_vect) {
+    TCCR1B = 0;
+    TIMSK1 = 0;
+    _zerocrossApply();
+}
+#endif
+
+bool _zerocrossLocked() {
+    unsigned long last;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        last = _zerocrossLast;
+    }
+    return (last != 0) && (micros() - last < 1000UL * ZEROCROSS_TIMEOUT);
+}
+
+// Returns the new number of entries, the caller makes sure there is room
+unsigned char _zerocrossMerge(zerocross_port_t * table, unsigned char count, const zerocross_port_t & entry) {
+    for (unsigned char i = 0; i < count; i++) {
+        if (table[i].port != entry.port) continue;
+        table[i].set = (table[i].set & ~entry.clear) | entry.set;
+        table[i].clear = (table[i].clear & ~entry.set) | entry.clear;
+        return count;
+    }
+    table[count] = entry;
+    return count + 1;
+}
+
+// -----------------------------------------------------------------------------
+// Public
+// -----------------------------------------------------------------------------
+
+/**
+ * Queues the pin level for the next crossing, zerocrossFlush() arms the batch
+ */
+void zerocrossWrite(unsigned char pin, bool level) {
+    volatile uint8_t * port = portOutputRegister(digitalPinToPort(pin));
+    uint8_t bit = digitalPinToBitMask(pin);
+    if (bit == 0) return;
+
+    // No room for another port, switch the batch so far right away
+    bool found = false;
+    for (unsigned char i = 0; i < _zerocrossPendingCount; i++) {
+        if (_zerocrossPending[i].port == port) found = true;
+    }
+    if (!found && _zerocrossPendingCount == ZEROCROSS_PORTS_MAX) zerocrossFlush();
+
+    zerocross_port_t entry = { port, (uint8_t) (level ? bit : 0), (uint8_t) (level ? 0 : bit) };
+    _zerocrossPendingCount = _zerocrossMerge(_zerocrossPending, _zerocrossPendingCount, entry);
+}
+
+/**
+ * Hands the pending writes to the interrupt, they are merged with the
+ * ones still waiting so everything goes out on the same crossing
+ */
+void zerocrossFlush() {
+    if (_zerocrossPendingCount == 0) return;
+
+    bool locked = _zerocrossLocked();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (unsigned char i = 0; i < _zerocrossPendingCount; i++) {
+            // A full table goes out now rather than dropping writes
+            if (_zerocrossArmedCount == ZEROCROSS_PORTS_MAX) _zerocrossApply();
+            _zerocrossArmedCount = _zerocrossMerge(_zerocrossArmed, _zerocrossArmedCount, _zerocrossPending[i]);
+        }
+        if (!locked) _zerocrossApply();
+    }
+    _zerocrossPendingCount = 0;
+
+    if (!locked) {
+        DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_VERBOSE, PSTR("[ZEROCROSS] No mains signal, switched right away\n"));
+    }
+}
+
+/**
+ * Microseconds between the last two crossings, 0 if there is no signal
+ */
+unsigned long zerocrossPeriod() {
+    if (!_zerocrossLocked()) return 0;
+    unsigned long period;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        period = _zerocrossPeriod;
+    }
+    return period;
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+void zerocrossSetup() {
+    TCCR1A = 0;
+    TCCR1B = 0;
+    pinMode(ZEROCROSS_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(ZEROCROSS_PIN), _zerocrossCrossing, RISING);
+    DEBUG_LOG_P(DEBUG_MODULE_RELAY, DEBUG_LEVEL_INFO, PSTR("[ZEROCROSS] Synchronized switching on pin %d\n"), ZEROCROSS_PIN);
+}
+
+#endif // ZEROCROSS_SUPPORT
@@ -0,0 +1,54 @@
+/*
+
+ZERO CROSS HEADER MODULE
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef ZEROCROSS_H
+#define ZEROCROSS_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "debug.h"
+
+// Delay GPIO relay changes to a fixed offset from the next mains zero crossing
+// All the relays changed in a relay loop pass switch on the same crossing
+// Only for RELAY_PROVIDER_RELAY, uses Timer1
+#ifndef ZEROCROSS_SUPPORT
+#define ZEROCROSS_SUPPORT           0
+#endif
+
+// Zero-cross detector output, must be an external interrupt pin (2 is INT4)
+#ifndef ZEROCROSS_PIN
+#define ZEROCROSS_PIN               2
+#endif
+
+// Microseconds from the crossing to the write, up to 32000
+// Half a mains period minus the relay operate time makes the contacts close at the next crossing
+// Longer offsets count from the first crossing after the flush, later ones do not restart it
+#ifndef ZEROCROSS_OFFSET
+#define ZEROCROSS_OFFSET            0
+#endif
+
+#if ZEROCROSS_OFFSET > 32000
+#error "ZEROCROSS_OFFSET is over 32000, Timer1 counts 16 bits at 2MHz"
+#endif
+
+// Without crossings for these many ms the relays are switched right away
+#ifndef ZEROCROSS_TIMEOUT
+#define ZEROCROSS_TIMEOUT           100
+#endif
+
+// Different output ports in a single batch
+#ifndef ZEROCROSS_PORTS_MAX
+#define ZEROCROSS_PORTS_MAX         4
+#endif
+
+void zerocrossWrite(unsigned char pin, bool level);
+void zerocrossFlush();
+unsigned long zerocrossPeriod();
+void zerocrossSetup();
+
+#endif
@@ -0,0 +1,4 @@
+# libFuzzer is only available with clang
+Import("env")
+
+env.Replace(CC="clang", CXX="clang++", LINK="clang++")
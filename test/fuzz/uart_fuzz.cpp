@@ -0,0 +1,79 @@
+/*
+
+UART FUZZ TARGET
+
+Copyright (C) 2019 by Shaeed Khan
+
+Feeds arbitrary bytes to the bridge port of the whole firmware, every
+frame goes through _receiveUART, _uartProcess and whatever it dispatches
+
+libFuzzer (needs clang):
+    pio run -e fuzz
+    .pio/build/fuzz/program -max_len=512 corpus_run test/fuzz/corpus
+
+Without FUZZ_LIBFUZZER the file has its own main() that runs every file
+given as argument, or stdin, once. That is the AFL entry point as well:
+    afl-fuzz -i test/fuzz/corpus -o findings -- ./uart_fuzz @@
+
+*/
+
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+bool _fuzzBooted = false;
+
+void _fuzzBoot() {
+    setSetting(K_NO_OF_RELAYS, 16);
+    for (unsigned char id = 0; id < 16; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, id & 1);
+    }
+    setup();
+    hostRun(100);
+    _fuzzBooted = true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    if (!_fuzzBooted) _fuzzBoot();
+
+    // Every poll takes at least one frame, then let the events and relays settle
+    HOST_BRIDGE.feed(data, size);
+    while (HOST_BRIDGE.available() > 0) hostRun(1);
+    hostRun(20);
+
+    HOST_BRIDGE.tx.clear();
+    Serial.tx.clear();
+    Serial2.tx.clear();
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+void _fuzzRun(std::istream & input) {
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        _fuzzRun(std::cin);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "Cannot read %s\n", argv[i]);
+            return 1;
+        }
+        _fuzzRun(file);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,372 @@
+/*
+
+HOST ARDUINO CORE
+
+Copyright (C) 2019 by Shaeed Khan
+
+Just enough of the Arduino core for the firmware to build and run on the
+host (PlatformIO native env). Time only moves when a test advances it, the
+serial ports are byte queues and pins live in a plain array.
+
+*/
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <strings.h>
+#include <deque>
+#include <string>
+
+#include "avr/pgmspace.h"
+#include "avr/io.h"
+#include "avr/interrupt.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH                0x1
+#define LOW                 0x0
+
+#define INPUT               0x0
+#define OUTPUT              0x1
+#define INPUT_PULLUP        0x2
+
+#define CHANGE              1
+#define FALLING             2
+#define RISING              3
+
+#define NOT_A_PIN           0
+#define NOT_AN_INTERRUPT    -1
+
+#define HOST_PINS           70          // Digital pins of a Mega
+#define HOST_PORTS          ((HOST_PINS + 7) / 8)
+#define HOST_INTERRUPTS     6
+
+// -----------------------------------------------------------------------------
+// Time
+// -----------------------------------------------------------------------------
+
+// Virtual clock in microseconds, moved by the tests and by delay()
+inline unsigned long hostMicros = 0;
+
+inline unsigned long micros() { return hostMicros; }
+inline unsigned long millis() { return hostMicros / 1000; }
+inline void delay(unsigned long ms) { hostMicros += ms * 1000; }
+inline void delayMicroseconds(unsigned int us) { hostMicros += us; }
+
+// -----------------------------------------------------------------------------
+// Pins
+// -----------------------------------------------------------------------------
+
+// Pin n is bit n % 8 of port n / 8, port numbers start at 1 like the core
+inline volatile uint8_t hostPorts[HOST_PORTS + 1];
+inline uint8_t hostPinModes[HOST_PINS];
+inline void (*hostInterrupts[HOST_INTERRUPTS])() = { 0 };
+inline int hostInterruptModes[HOST_INTERRUPTS];
+
+// Called after every digitalWrite if set, a test hangs a device there (latch, chip select)
+inline void (*hostPinWrite)(uint8_t pin, uint8_t value) = 0;
+
+inline uint8_t digitalPinToPort(uint8_t pin) { return pin < HOST_PINS ? pin / 8 + 1 : NOT_A_PIN; }
+inline uint8_t digitalPinToBitMask(uint8_t pin) { return pin < HOST_PINS ? 1 << (pin % 8) : 0; }
+inline volatile uint8_t * portOutputRegister(uint8_t port) { return &hostPorts[port]; }
+inline volatile uint8_t * portInputRegister(uint8_t port) { return &hostPorts[port]; }
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin < HOST_PINS) hostPinModes[pin] = mode;
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+    if (pin >= HOST_PINS) return;
+    if (value) {
+        hostPorts[digitalPinToPort(pin)] |= digitalPinToBitMask(pin);
+    } else {
+        hostPorts[digitalPinToPort(pin)] &= ~digitalPinToBitMask(pin);
+    }
+    if (hostPinWrite) hostPinWrite(pin, value);
+}
+
+inline int digitalRead(uint8_t pin) {
+    if (pin >= HOST_PINS) return LOW;
+    return (hostPorts[digitalPinToPort(pin)] & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+// Same numbering as the Mega core
+inline int digitalPinToInterrupt(uint8_t pin) {
+    switch (pin) {
+        case 2: return 0;
+        case 3: return 1;
+        case 21: return 2;
+        case 20: return 3;
+        case 19: return 4;
+        case 18: return 5;
+        default: return NOT_AN_INTERRUPT;
+    }
+}
+
+inline void attachInterrupt(int interrupt, void (*callback)(), int mode) {
+    if (interrupt < 0 || interrupt >= HOST_INTERRUPTS) return;
+    hostInterrupts[interrupt] = callback;
+    hostInterruptModes[interrupt] = mode;
+}
+
+inline void detachInterrupt(int interrupt) {
+    if (interrupt < 0 || interrupt >= HOST_INTERRUPTS) return;
+    hostInterrupts[interrupt] = NULL;
+}
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// -----------------------------------------------------------------------------
+// String, heap backed like the core one so the allocation counters see it
+// -----------------------------------------------------------------------------
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *) (s))
+
+class String {
+
+    public:
+
+        String(const char * s = "") { _assign(s ? s : "", s ? strlen(s) : 0); }
+        String(const __FlashStringHelper * s) : String((const char *) s) {}
+        String(const String & s) { _assign(s.c_str(), s._length); }
+        String(char c) { _assign(&c, 1); }
+        String(unsigned char n, unsigned char base = 10) { _number(n, base); }
+        String(int n, unsigned char base = 10) { _signed(n, base); }
+        String(unsigned int n, unsigned char base = 10) { _number(n, base); }
+        String(long n, unsigned char base = 10) { _signed(n, base); }
+        String(unsigned long n, unsigned char base = 10) { _number(n, base); }
+        String(double n, unsigned char decimals = 2) {
+            char buffer[33];
+            snprintf(buffer, sizeof(buffer), "%.*f", decimals, n);
+            _assign(buffer, strlen(buffer));
+        }
+        ~String() { free(_buffer); }
+
+        String & operator=(const String & s) {
+            if (this != &s) _assign(s.c_str(), s._length);
+            return *this;
+        }
+
+        String & operator=(const char * s) {
+            _assign(s ? s : "", s ? strlen(s) : 0);
+            return *this;
+        }
+
+        unsigned int length() const { return _length; }
+        const char * c_str() const { return _buffer ? _buffer : ""; }
+        char charAt(unsigned int index) const { return index < _length ? _buffer[index] : 0; }
+        char operator[](unsigned int index) const { return charAt(index); }
+        long toInt() const { return atol(c_str()); }
+        float toFloat() const { return atof(c_str()); }
+
+        bool reserve(unsigned int size) {
+            if (size < _capacity) return true;
+            char * buffer = (char *) realloc(_buffer, size + 1);
+            if (buffer == NULL) return false;
+            if (_buffer == NULL) buffer[0] = '\0';
+            _buffer = buffer;
+            _capacity = size + 1;
+            return true;
+        }
+
+        bool concat(const char * s, unsigned int length) {
+            if (!reserve(_length + length)) return false;
+            memcpy(_buffer + _length, s, length);
+            _length += length;
+            _buffer[_length] = '\0';
+            return true;
+        }
+
+        String & operator+=(const String & s) { concat(s.c_str(), s._length); return *this; }
+        String & operator+=(const char * s) { concat(s, strlen(s)); return *this; }
+        String & operator+=(char c) { concat(&c, 1); return *this; }
+
+        friend String operator+(const String & a, const String & b) {
+            String result(a);
+            result += b;
+            return result;
+        }
+
+        bool equals(const String & s) const { return _length == s._length && strcmp(c_str(), s.c_str()) == 0; }
+        bool operator==(const String & s) const { return equals(s); }
+        bool operator==(const char * s) const { return strcmp(c_str(), s) == 0; }
+        bool operator!=(const String & s) const { return !equals(s); }
+        bool operator<(const String & s) const { return strcmp(c_str(), s.c_str()) < 0; }
+
+        bool startsWith(const String & s) const {
+            return s._length <= _length && strncmp(c_str(), s.c_str(), s._length) == 0;
+        }
+
+        bool endsWith(const String & s) const {
+            return s._length <= _length && strcmp(c_str() + _length - s._length, s.c_str()) == 0;
+        }
+
+        int indexOf(char c, unsigned int from = 0) const {
+            if (from >= _length) return -1;
+            const char * p = strchr(c_str() + from, c);
+            return p ? p - c_str() : -1;
+        }
+
+        String substring(unsigned int from, unsigned int to = (unsigned int) -1) const {
+            if (to > _length) to = _length;
+            if (from >= to) return String();
+            String result;
+            result.concat(c_str() + from, to - from);
+            return result;
+        }
+
+        void toCharArray(char * buffer, unsigned int size) const {
+            if (size == 0) return;
+            unsigned int length = _length < size - 1 ? _length : size - 1;
+            memcpy(buffer, c_str(), length);
+            buffer[length] = '\0';
+        }
+
+    private:
+
+        char * _buffer = NULL;
+        unsigned int _capacity = 0;
+        unsigned int _length = 0;
+
+        void _assign(const char * s, unsigned int length) {
+            _length = 0;
+            if (_buffer) _buffer[0] = '\0';
+            concat(s, length);
+        }
+
+        void _number(unsigned long n, unsigned char base) {
+            char buffer[33];
+            char * p = buffer + sizeof(buffer) - 1;
+            *p = '\0';
+            do {
+                unsigned char digit = n % base;
+                *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+                n /= base;
+            } while (n > 0);
+            _assign(p, strlen(p));
+        }
+
+        void _signed(long n, unsigned char base) {
+            if (n >= 0 || base != 10) {
+                _number((unsigned long) n, base);
+                return;
+            }
+            _number((unsigned long) -n, base);
+            String sign('-');
+            sign += *this;
+            *this = sign;
+        }
+
+};
+
+// -----------------------------------------------------------------------------
+// Streams
+// -----------------------------------------------------------------------------
+
+class Print {
+
+    public:
+
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c) = 0;
+
+        virtual size_t write(const uint8_t * buffer, size_t size) {
+            size_t n = 0;
+            while (size--) n += write(*buffer++);
+            return n;
+        }
+
+        size_t write(const char * s) { return s ? write((const uint8_t *) s, strlen(s)) : 0; }
+        size_t write(const char * buffer, size_t size) { return write((const uint8_t *) buffer, size); }
+        virtual int availableForWrite() { return 0; }
+        virtual void flush() {}
+
+        size_t print(const char * s) { return write(s); }
+        size_t print(const __FlashStringHelper * s) { return write((const char *) s); }
+        size_t print(const String & s) { return write(s.c_str(), s.length()); }
+        size_t print(char c) { return write((uint8_t) c); }
+        size_t print(long n, int base = 10) { return print(String(n, base)); }
+        size_t print(unsigned long n, int base = 10) { return print(String(n, base)); }
+        size_t print(int n, int base = 10) { return print((long) n, base); }
+        size_t print(unsigned int n, int base = 10) { return print((unsigned long) n, base); }
+        size_t println() { return write("\r\n"); }
+        template<typename T> size_t println(T value) { return print(value) + println(); }
+
+};
+
+class Stream : public Print {
+
+    public:
+
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+
+};
+
+/*
+ * Bytes queued in rx are what the other end sent, whatever the firmware
+ * writes ends up in tx until the test takes it
+ */
+class HardwareSerial : public Stream {
+
+    public:
+
+        std::deque<uint8_t> rx;
+        std::string tx;
+        unsigned long baud = 0;     // 0 while closed
+        int room = 63;              // availableForWrite(), the core TX ring keeps one byte free
+        size_t unsent = 0;          // Written since the last flush()
+
+        void begin(unsigned long speed) { baud = speed; }
+        void end() { baud = 0; }
+        int available() { return rx.size(); }
+
+        int read() {
+            if (rx.empty()) return -1;
+            uint8_t c = rx.front();
+            rx.pop_front();
+            return c;
+        }
+
+        int peek() { return rx.empty() ? -1 : rx.front(); }
+        size_t write(uint8_t c) { tx.push_back((char) c); unsent++; return 1; }
+        using Print::write;
+        int availableForWrite() { return room; }
+
+        // Blocks like the core one, the clock moves on while the bytes are on the wire
+        void flush() {
+            if (baud) hostMicros += (unsent * 10000000UL + baud - 1) / baud;
+            unsent = 0;
+        }
+
+        operator bool() { return true; }
+
+        // Test side helpers
+        void feed(const char * s) { while (*s) rx.push_back((uint8_t) *s++); }
+        void feed(const uint8_t * data, size_t size) { rx.insert(rx.end(), data, data + size); }
+
+        std::string take() {
+            std::string out;
+            out.swap(tx);
+            return out;
+        }
+
+};
+
+inline HardwareSerial Serial;
+inline HardwareSerial Serial1;
+inline HardwareSerial Serial2;
+inline HardwareSerial Serial3;
+
+#endif
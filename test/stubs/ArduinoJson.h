@@ -0,0 +1,14 @@
+/*
+
+HOST ARDUINOJSON
+
+Copyright (C) 2019 by Shaeed Khan
+
+Included by the firmware headers but nothing uses it, the JSON import has its own parser
+
+*/
+
+#ifndef HOST_ARDUINOJSON_H
+#define HOST_ARDUINOJSON_H
+
+#endif
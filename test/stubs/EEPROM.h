@@ -0,0 +1,50 @@
+/*
+
+HOST EEPROM
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <Arduino.h>
+
+class EEPROMClass {
+
+    public:
+
+        uint8_t data[E2END + 1];
+        unsigned long writes = 0;   // Cells actually written, wear check for the tests
+
+        EEPROMClass() { memset(data, 0xFF, sizeof(data)); }
+        uint8_t read(int address) { return data[address]; }
+
+        void write(int address, uint8_t value) {
+            data[address] = value;
+            writes++;
+        }
+
+        void update(int address, uint8_t value) {
+            if (data[address] != value) write(address, value);
+        }
+
+        uint16_t length() { return E2END + 1; }
+
+        template<typename T> T & get(int address, T & t) {
+            memcpy(&t, data + address, sizeof(T));
+            return t;
+        }
+
+        template<typename T> const T & put(int address, const T & t) {
+            const uint8_t * p = (const uint8_t *) &t;
+            for (size_t i = 0; i < sizeof(T); i++) update(address + i, p[i]);
+            return t;
+        }
+
+};
+
+inline EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,49 @@
+/*
+
+HOST EMBEDIS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Settings in a map instead of the EEPROM dictionary, writes are counted
+so tests can check what a code path commits
+
+*/
+
+#ifndef HOST_EMBEDIS_H
+#define HOST_EMBEDIS_H
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+
+inline std::map<std::string, std::string> hostSettings;
+inline unsigned long hostSettingsWrites = 0;
+
+class Embedis {
+
+    public:
+
+        static bool get(const String & key, String & value) {
+            auto it = hostSettings.find(key.c_str());
+            if (it == hostSettings.end()) return false;
+            value = it->second.c_str();
+            return true;
+        }
+
+        static bool set(const String & key, const String & value) {
+            hostSettings[key.c_str()] = value.c_str();
+            hostSettingsWrites++;
+            return true;
+        }
+
+        static bool del(const String & key) {
+            if (hostSettings.erase(key.c_str()) == 0) return false;
+            hostSettingsWrites++;
+            return true;
+        }
+
+        template<typename R, typename W> static void dictionary(const __FlashStringHelper *, size_t, R, W) {}
+
+};
+
+#endif
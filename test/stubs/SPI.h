@@ -0,0 +1,45 @@
+/*
+
+HOST SPI
+
+Copyright (C) 2019 by Shaeed Khan
+
+Every byte goes to hostSpiTransfer if set, a test hangs a device there
+
+*/
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+#define MSBFIRST                    1
+#define LSBFIRST                    0
+#define SPI_MODE0                   0x00
+
+class SPISettings {
+
+    public:
+
+        SPISettings() {}
+        SPISettings(uint32_t, uint8_t, uint8_t) {}
+
+};
+
+inline uint8_t (*hostSpiTransfer)(uint8_t data) = 0;
+
+class SPIClass {
+
+    public:
+
+        void begin() {}
+        void end() {}
+        void beginTransaction(SPISettings) {}
+        void endTransaction() {}
+        uint8_t transfer(uint8_t data) { return hostSpiTransfer ? hostSpiTransfer(data) : 0; }
+
+};
+
+inline SPIClass SPI;
+
+#endif
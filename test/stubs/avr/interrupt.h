@@ -0,0 +1,20 @@
+/*
+
+HOST AVR INTERRUPTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Vectors become plain functions a test calls to raise the interrupt
+
+*/
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define ISR(vector, ...)            extern "C" void vector(void)
+#define ISR_NOBLOCK
+
+#define cli()
+#define sei()
+
+#endif
@@ -0,0 +1,120 @@
+/*
+
+HOST AVR REGISTERS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Registers are plain bytes, a test plays the peripheral by watching them
+TWCR and TWSR take a write hook so a fake I2C device can react
+
+*/
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+class HostRegister {
+
+    public:
+
+        void (*onWrite)(uint8_t value) = 0;
+
+        HostRegister & operator=(uint8_t value) {
+            _value = value;
+            if (onWrite) onWrite(value);
+            return *this;
+        }
+
+        HostRegister & operator|=(uint8_t value) { return *this = _value | value; }
+        HostRegister & operator&=(uint8_t value) { return *this = _value & value; }
+        operator uint8_t() const { return _value; }
+
+        // Hardware side, no hook
+        void set(uint8_t value) { _value = value; }
+
+    private:
+
+        volatile uint8_t _value = 0;
+
+};
+
+#define HOST_REGISTER(name)         inline volatile uint8_t name;
+
+HOST_REGISTER(PINB)
+HOST_REGISTER(PORTB)
+HOST_REGISTER(DDRB)
+HOST_REGISTER(PINK)
+HOST_REGISTER(PORTK)
+HOST_REGISTER(DDRK)
+HOST_REGISTER(PCICR)
+HOST_REGISTER(PCIFR)
+HOST_REGISTER(PCMSK0)
+HOST_REGISTER(PCMSK1)
+HOST_REGISTER(PCMSK2)
+HOST_REGISTER(MCUSR)
+HOST_REGISTER(WDTCSR)
+HOST_REGISTER(SREG)
+HOST_REGISTER(TCCR1A)
+HOST_REGISTER(TCCR1B)
+HOST_REGISTER(TIMSK1)
+HOST_REGISTER(TIFR1)
+HOST_REGISTER(TWBR)
+HOST_REGISTER(TWDR)
+HOST_REGISTER(SPCR)
+HOST_REGISTER(SPSR)
+HOST_REGISTER(SPDR)
+HOST_REGISTER(UCSR1A)
+
+inline HostRegister TWCR;
+inline HostRegister TWSR;
+
+inline volatile uint16_t OCR1A;
+inline volatile uint16_t TCNT1;
+inline volatile uint16_t SP = 0x21FF;
+
+#define _BV(bit)                    (1 << (bit))
+
+#define RAMEND                      0x21FF
+#define E2END                       0xFFF
+#ifndef F_CPU
+#define F_CPU                       16000000UL
+#endif
+
+#define PCIE0                       0
+#define PCIE1                       1
+#define PCIE2                       2
+
+#define PORF                        0
+#define EXTRF                       1
+#define BORF                        2
+#define WDRF                        3
+
+#define WDP0                        0
+#define WDP1                        1
+#define WDP2                        2
+#define WDE                         3
+#define WDCE                        4
+#define WDP3                        5
+#define WDIE                        6
+#define WDIF                        7
+
+#define WGM12                       3
+#define CS10                        0
+#define CS11                        1
+#define CS12                        2
+#define OCIE1A                      1
+#define OCF1A                       1
+
+#define DOR1                        3
+#define FE1                         4
+
+#define TWIE                        0
+#define TWEN                        2
+#define TWWC                        3
+#define TWSTO                       4
+#define TWSTA                       5
+#define TWEA                        6
+#define TWINT                       7
+
+#endif
@@ -0,0 +1,40 @@
+/*
+
+HOST AVR PGMSPACE
+
+Copyright (C) 2019 by Shaeed Khan
+
+Flash and RAM are the same thing on the host
+
+*/
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PGM_P                       const char *
+#define PSTR(s)                     (s)
+
+#define pgm_read_byte(p)            (*(const uint8_t *) (p))
+#define pgm_read_word(p)            (*(const uint16_t *) (p))
+#define pgm_read_dword(p)           (*(const uint32_t *) (p))
+#define pgm_read_ptr(p)             (*(void * const *) (p))
+
+#define strlen_P                    strlen
+#define strcpy_P                    strcpy
+#define strncpy_P                   strncpy
+#define memcpy_P                    memcpy
+#define strcmp_P                    strcmp
+#define strncmp_P                   strncmp
+#define strcasecmp_P                strcasecmp
+#define strncasecmp_P               strncasecmp
+#define sprintf_P                   sprintf
+#define snprintf_P                  snprintf
+#define vsnprintf_P                 vsnprintf
+
+#endif
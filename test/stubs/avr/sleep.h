@@ -0,0 +1,20 @@
+/*
+
+HOST AVR SLEEP
+
+Copyright (C) 2019 by Shaeed Khan
+
+*/
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE             0
+
+inline void set_sleep_mode(int) {}
+inline void sleep_enable() {}
+inline void sleep_disable() {}
+inline void sleep_cpu() {}
+inline void sleep_mode() {}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+
+HOST TEST HELPERS
+
+Copyright (C) 2019 by Shaeed Khan
+
+The whole firmware is linked into every native test (test_build_src),
+a suite boots it once with setup() and drives it through the bridge port
+
+*/
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <Arduino.h>
+#include <string>
+#include <chrono>
+
+void setup();
+void loop();
+
+// Port the bridge talks to, UART_HW_PORT
+#define HOST_BRIDGE                 Serial1
+
+/**
+ * Runs the loop for ms of virtual time, one pass every step microseconds
+ * Debug and telemetry output is dropped, only the bridge port is kept
+ */
+inline void hostRun(unsigned long ms, unsigned long step = 1000) {
+    unsigned long end = hostMicros + ms * 1000;
+    while (hostMicros < end) {
+        loop();
+        hostMicros += step;
+        Serial.tx.clear();
+        Serial2.tx.clear();
+    }
+}
+
+/**
+ * Sends a frame from the bridge, the end symbol and termination are added
+ */
+inline void hostSend(const char * frame) {
+    HOST_BRIDGE.feed(frame);
+    HOST_BRIDGE.feed("~\n");
+}
+
+/**
+ * Everything the firmware sent to the bridge since the last call
+ */
+inline std::string hostReceive() {
+    return HOST_BRIDGE.take();
+}
+
+/**
+ * Sends a frame, runs the loop for ms and returns what came back
+ */
+inline std::string hostExchange(const char * frame, unsigned long ms = 10) {
+    hostReceive();
+    hostSend(frame);
+    hostRun(ms);
+    return hostReceive();
+}
+
+// Wall clock for the benchmarks, the virtual one does not move by itself
+inline double hostSeconds() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
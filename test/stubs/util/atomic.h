@@ -0,0 +1,18 @@
+/*
+
+HOST AVR ATOMIC BLOCKS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Nothing interrupts the host build, tests raise interrupts between calls
+
+*/
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE         0
+#define ATOMIC_FORCEON              1
+#define ATOMIC_BLOCK(type)          for (int _atomic = 1; _atomic; _atomic = 0)
+
+#endif
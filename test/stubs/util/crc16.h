@@ -0,0 +1,38 @@
+/*
+
+HOST AVR CRC
+
+Copyright (C) 2019 by Shaeed Khan
+
+C versions of the avr-libc routines, same results
+
+*/
+
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <stdint.h>
+
+inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+    crc ^= a;
+    for (int i = 0; i < 8; ++i) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+    return crc;
+}
+
+inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+    data ^= crc & 0xFF;
+    data ^= data << 4;
+    return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4) ^ ((uint16_t) data << 3));
+}
+
+inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data) {
+    crc = crc ^ data;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+    }
+    return crc;
+}
+
+#endif
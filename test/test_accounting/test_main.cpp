@@ -0,0 +1,69 @@
+/*
+
+ACCOUNTING TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Periodic saves over a few hours of virtual time
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "accounting.h"
+
+#define HOUR                        3600UL
+
+void setUp() {}
+void tearDown() {}
+
+// Stored on time of the relay, 0 if there is no record
+unsigned long _stored(unsigned char id) {
+    unsigned char record[ACCOUNTING_RECORD_SIZE];
+    if (hexDecode(getSetting(K_ACCOUNTING, id, "").c_str(), record, ACCOUNTING_RECORD_SIZE) != ACCOUNTING_RECORD_SIZE) return 0;
+    return ((unsigned long) record[0] << 24) | ((unsigned long) record[1] << 16) | (record[2] << 8) | record[3];
+}
+
+void test_on_relay_is_saved_every_interval() {
+    hostExchange("2relay/0 1");
+    TEST_ASSERT_TRUE(relayStatus(0));
+
+    // Switched once, then only its on time changes
+    hostRun(ACCOUNTING_SAVE_INTERVAL + 1000, 1000000);
+    unsigned long first = _stored(0);
+    TEST_ASSERT_GREATER_OR_EQUAL(1, first);
+
+    hostRun(ACCOUNTING_SAVE_INTERVAL, 1000000);
+    TEST_ASSERT_UINT_WITHIN(2, first + ACCOUNTING_SAVE_INTERVAL / 1000, _stored(0));
+    TEST_ASSERT_FALSE(hasSetting(K_ACCOUNTING, 1));
+}
+
+void test_idle_relays_are_not_written() {
+    hostExchange("2relay/0 0");
+    hostRun(ACCOUNTING_SAVE_INTERVAL, 1000000);
+    unsigned long on_time = _stored(0);
+    TEST_ASSERT_EQUAL(accountingOnTime(0), on_time);
+
+    // Everything OFF and saved, nothing left to write
+    unsigned long writes = hostSettingsWrites;
+    hostRun(2 * ACCOUNTING_SAVE_INTERVAL, 1000000);
+    TEST_ASSERT_EQUAL(writes, hostSettingsWrites);
+    TEST_ASSERT_EQUAL(on_time, _stored(0));
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, 2);
+    for (unsigned char id = 0; id < 2; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_on_relay_is_saved_every_interval);
+    RUN_TEST(test_idle_relays_are_not_written);
+    return UNITY_END();
+}
@@ -0,0 +1,254 @@
+/*
+
+ACK WINDOW TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+The test plays the bridge: a go-back-N sender that keeps up to window
+sequenced frames in flight over a simulated link to the firmware. Bytes
+take their time on the wire at UART_BAUDRATE plus LINK_LATENCY each way.
+Every command is a SETT get with exactly one reply, so counting replies
+shows that each one ran once, whatever was resent.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include <deque>
+#include "settings.h"
+#include "relay.h"
+#include "uart.h"
+
+#define LINK_LATENCY                1000        // One way, bridge processing included (us)
+#define LINK_TIMEOUT                30000       // Go back to the oldest unacknowledged frame (us)
+#define STEP                        100         // Loop pass (us)
+#define COMMANDS                    600         // Wraps the sequence numbers twice
+#define COMMAND                     "3b"
+
+typedef struct {
+    unsigned long time;                         // Last byte in at the other end
+    std::string bytes;
+} packet_t;
+
+typedef struct {
+    std::deque<packet_t> packets;
+    unsigned long free;                         // The wire is busy until then
+} link_t;
+
+typedef struct {
+    unsigned char window;
+    unsigned char base;                         // Oldest unacknowledged sequence number
+    unsigned char next;                         // Next sequence number to send
+    unsigned long sent;                         // Commands sent at least once
+    unsigned long acked;
+    unsigned long resent;
+    unsigned long replies;
+    unsigned long timer;                        // Last progress
+    unsigned int loss;                          // Frames dropped on the way to the firmware, per 1000
+    std::string partial;
+} sender_t;
+
+link_t _toMega;
+link_t _toBridge;
+unsigned long _random = 1;
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// Link
+// -----------------------------------------------------------------------------
+
+void _linkSend(link_t & link, const std::string & bytes) {
+    unsigned long start = link.free > hostMicros ? link.free : hostMicros;
+    link.free = start + (bytes.size() * 10000000UL + UART_BAUDRATE - 1) / UART_BAUDRATE;
+    link.packets.push_back((packet_t) { link.free + LINK_LATENCY, bytes });
+}
+
+std::string _linkReceive(link_t & link) {
+    std::string bytes;
+    while (!link.packets.empty() && (link.packets.front().time <= hostMicros)) {
+        bytes += link.packets.front().bytes;
+        link.packets.pop_front();
+    }
+    return bytes;
+}
+
+bool _lost(unsigned int loss) {
+    _random = _random * 1103515245UL + 12345UL;
+    return ((_random >> 16) % 1000) < loss;
+}
+
+// -----------------------------------------------------------------------------
+// Sender
+// -----------------------------------------------------------------------------
+
+void _senderFrame(sender_t & sender, unsigned char seq, const char * command) {
+    char frame[16];
+    snprintf(frame, sizeof(frame), "#%02X%s~\n", seq, command);
+    if (!_lost(sender.loss)) _linkSend(_toMega, frame);
+}
+
+void _senderReceive(sender_t & sender, const std::string & bytes) {
+    for (char c : bytes) {
+        if (c != '\n') {
+            sender.partial += c;
+            continue;
+        }
+
+        const char * frame = sender.partial.c_str();
+        if (frame[0] == UART_ACK_SYMBOL) {
+            unsigned char ack;
+            if (hexDecode(frame + 1, &ack, 1) == 1) {
+                unsigned char newly = ack - sender.base;
+                if (newly > 0 && newly <= (unsigned char) (sender.next - sender.base)) {
+                    sender.acked += newly;
+                    sender.base = ack;
+                    sender.timer = hostMicros;
+                }
+            }
+            frame += 3;
+        }
+        if (strncmp(frame, "4b", 2) == 0) sender.replies++;
+        sender.partial.clear();
+    }
+}
+
+/**
+ * Runs the link and the firmware until every command is acknowledged
+ */
+void _senderRun(sender_t & sender, unsigned long commands) {
+    sender.timer = hostMicros;
+    unsigned long deadline = hostMicros + 1000000UL * 60;
+
+    while (sender.acked < commands && hostMicros < deadline) {
+
+        // Fill the window
+        while ((unsigned char) (sender.next - sender.base) < sender.window && (sender.acked + (unsigned char) (sender.next - sender.base)) < commands) {
+            if (sender.acked + (unsigned char) (sender.next - sender.base) >= sender.sent) {
+                sender.sent++;
+            } else {
+                sender.resent++;
+            }
+            _senderFrame(sender, sender.next++, COMMAND);
+        }
+
+        // Nothing acknowledged for a while, everything from base goes again
+        if ((sender.next != sender.base) && (hostMicros - sender.timer >= LINK_TIMEOUT)) {
+            sender.next = sender.base;
+            sender.timer = hostMicros;
+        }
+
+        std::string bytes = _linkReceive(_toMega);
+        if (!bytes.empty()) HOST_BRIDGE.feed((const uint8_t *) bytes.data(), bytes.size());
+        loop();
+        hostMicros += STEP;
+        Serial.tx.clear();
+        Serial2.tx.clear();
+
+        std::string out = hostReceive();
+        if (!out.empty()) _linkSend(_toBridge, out);
+        _senderReceive(sender, _linkReceive(_toBridge));
+    }
+
+    // Whatever is still on the way
+    for (unsigned char i = 0; i < 50; i++) {
+        hostRun(1, STEP);
+        std::string out = hostReceive();
+        if (!out.empty()) _linkSend(_toBridge, out);
+        _senderReceive(sender, _linkReceive(_toBridge));
+    }
+}
+
+/**
+ * Restarts the sequence numbers at 0 on both ends
+ */
+sender_t _senderBegin(unsigned char window, unsigned int loss) {
+    hostRun(50);
+    hostExchange("3c");
+    _toMega.packets.clear();
+    _toBridge.packets.clear();
+    return (sender_t) { window, 0, 0, 0, 0, 0, 0, 0, loss, "" };
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_window_throughput() {
+    static const unsigned char windows[] = { 1, 2, UART_ACK_WINDOW };
+    double rates[sizeof(windows)];
+
+    for (unsigned char i = 0; i < sizeof(windows); i++) {
+        sender_t sender = _senderBegin(windows[i], 0);
+        unsigned long start = hostMicros;
+        _senderRun(sender, COMMANDS);
+        rates[i] = COMMANDS / ((hostMicros - start) / 1e6);
+
+        TEST_ASSERT_EQUAL(COMMANDS, sender.acked);
+        TEST_ASSERT_EQUAL(COMMANDS, sender.replies);
+        TEST_ASSERT_EQUAL(0, sender.resent);
+
+        char message[64];
+        snprintf(message, sizeof(message), "window %u: %.0f commands/s", windows[i], rates[i]);
+        TEST_MESSAGE(message);
+    }
+
+    // Several in flight hide the round trip
+    TEST_ASSERT_GREATER_THAN(1.5 * rates[0], rates[sizeof(windows) - 1]);
+}
+
+void test_lossy_link_runs_everything_once() {
+    sender_t sender = _senderBegin(UART_ACK_WINDOW, 50);
+    _senderRun(sender, COMMANDS);
+    TEST_ASSERT_EQUAL(COMMANDS, sender.acked);
+    TEST_ASSERT_EQUAL(COMMANDS, sender.replies);
+    TEST_ASSERT_GREATER_THAN(0, sender.resent);
+
+    char message[64];
+    snprintf(message, sizeof(message), "5%% loss: %lu frames resent", sender.resent);
+    TEST_MESSAGE(message);
+}
+
+/**
+ * Duplicates and frames after a gap are dropped, the ACK always names the
+ * next frame expected, across the wrap from 255 to 0
+ */
+void test_duplicates_gap_and_wrap() {
+    sender_t sender = _senderBegin(UART_ACK_WINDOW, 0);
+    _senderRun(sender, 254);
+    TEST_ASSERT_EQUAL(254, sender.replies);
+    TEST_ASSERT_EQUAL(0xFE, sender.base);
+
+    // Duplicate
+    std::string reply = hostExchange("#FE" COMMAND);
+    TEST_ASSERT_TRUE(reply.find("@FF4b") == 0);
+    reply = hostExchange("#FE" COMMAND);
+    TEST_ASSERT_TRUE(reply.find("4b") == std::string::npos);
+    TEST_ASSERT_TRUE(reply.find("@FF~\n") != std::string::npos);
+
+    // Gap, #FF is missing
+    reply = hostExchange("#00" COMMAND);
+    TEST_ASSERT_TRUE(reply.find("4b") == std::string::npos);
+    TEST_ASSERT_TRUE(reply.find("@FF~\n") != std::string::npos);
+
+    // Resent in order, through the wrap
+    reply = hostExchange("#FF" COMMAND);
+    TEST_ASSERT_TRUE(reply.find("@004b") == 0);
+    reply = hostExchange("#00" COMMAND);
+    TEST_ASSERT_TRUE(reply.find("@014b") == 0);
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, 1);
+    setSetting(K_RELAY_PIN, 0, 22);
+    setSetting(K_RELAY_TYPE, 0, RELAY_TYPE_NORMAL);
+    setup();
+    hostRun(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_window_throughput);
+    RUN_TEST(test_lossy_link_runs_everything_once);
+    RUN_TEST(test_duplicates_gap_and_wrap);
+    return UNITY_END();
+}
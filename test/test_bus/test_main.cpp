@@ -0,0 +1,375 @@
+/*
+
+BUS TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+NODES controllers on a virtual half-duplex bus (pio test -e native_bus -v)
+Every node is its own process running the firmware, the test is the master
+and moves all the clocks forward in lockstep, one TICK at a time. Bytes on
+the wire reach the other ends on the first tick after the last one is out,
+two senders on the wire at once count as a collision.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <vector>
+#include "settings.h"
+#include "relay.h"
+#include "uart.h"
+
+#define NODES                       8
+#define NODE_RELAYS                 8
+#define NODE_STEP                   100         // Loop pass of the nodes (us)
+#define TICK                        1000        // Bus lockstep (us)
+#define MASTER                      NODES
+#define ROUNDS                      16
+
+typedef struct {
+    unsigned long until;
+    unsigned long length;
+} tick_t;
+
+typedef struct {
+    unsigned long start;
+    unsigned long end;
+    unsigned long length;
+} reply_t;
+
+typedef struct {
+    unsigned long start;
+    unsigned long end;
+    unsigned char sender;
+} transmission_t;
+
+typedef struct {
+    unsigned long time;                         // Last byte in
+    unsigned char node;
+    std::string frame;
+} heard_t;
+
+typedef struct {
+    unsigned long time;                         // Last byte off the wire
+    std::string bytes;
+} delivery_t;
+
+typedef struct {
+    pid_t pid;
+    int in;
+    int out;
+    std::vector<delivery_t> rx;
+} node_t;
+
+node_t _nodes[NODES];
+unsigned long _now = 0;
+unsigned long _collisions = 0;
+unsigned long _wireBytes = 0;
+std::vector<transmission_t> _transmissions;
+std::vector<heard_t> _heard;
+std::string _master;                            // Partial frame the master is reading
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// Pipes
+// -----------------------------------------------------------------------------
+
+bool _read(int fd, void * data, size_t size) {
+    char * p = (char *) data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void _write(int fd, const void * data, size_t size) {
+    const char * p = (const char *) data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) _exit(1);
+        p += n;
+        size -= n;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Node side
+// -----------------------------------------------------------------------------
+
+/**
+ * Boots the firmware and runs it one tick at a time, whatever it sent
+ * during the tick goes back to the master with when it was on the wire
+ */
+void _node(unsigned char address, int in, int out) {
+    setSetting(K_BUS_ADDRESS, address);
+    setSetting(K_NO_OF_RELAYS, NODE_RELAYS);
+    for (unsigned char id = 0; id < NODE_RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(100, NODE_STEP);
+    HOST_BRIDGE.take();
+
+    tick_t tick;
+    while (_read(in, &tick, sizeof(tick))) {
+        std::string rx(tick.length, '\0');
+        if (tick.length && !_read(in, &rx[0], tick.length)) break;
+        HOST_BRIDGE.feed((const uint8_t *) rx.data(), rx.size());
+
+        reply_t reply = { 0, 0, 0 };
+        std::string sent;
+        if (hostMicros < tick.until - TICK) hostMicros = tick.until - TICK;
+        while (hostMicros < tick.until) {
+            unsigned long before = hostMicros;
+            loop();
+            if (!HOST_BRIDGE.tx.empty()) {
+                if (sent.empty()) reply.start = before;
+                sent += HOST_BRIDGE.take();
+                reply.end = hostMicros;
+            }
+            hostMicros += NODE_STEP;
+            Serial.tx.clear();
+            Serial2.tx.clear();
+        }
+
+        reply.length = sent.size();
+        _write(out, &reply, sizeof(reply));
+        _write(out, sent.data(), sent.size());
+    }
+    _exit(0);
+}
+
+// -----------------------------------------------------------------------------
+// Master side
+// -----------------------------------------------------------------------------
+
+unsigned long _wireTime(size_t bytes) {
+    return (bytes * 10000000UL + UART_BAUDRATE - 1) / UART_BAUDRATE;
+}
+
+void _transmit(unsigned char sender, unsigned long start, unsigned long end) {
+    for (const transmission_t & t : _transmissions) {
+        if ((t.sender != sender) && (t.start < end) && (start < t.end)) _collisions++;
+    }
+    _transmissions.push_back((transmission_t) { start, end, sender });
+    if (_transmissions.size() > 64) _transmissions.erase(_transmissions.begin());
+}
+
+void _masterHear(unsigned long time, const std::string & bytes) {
+    for (char c : bytes) {
+        _master += c;
+        if (c != '\n') continue;
+        heard_t heard = { time, (unsigned char) (_master[0] - UART_BUS_ADDRESS_BASE), _master.substr(1) };
+        _heard.push_back(heard);
+        _master.clear();
+    }
+}
+
+/**
+ * Moves the whole bus one tick forward
+ */
+void _tick() {
+    for (unsigned char i = 0; i < NODES; i++) {
+        std::string rx;
+        std::vector<delivery_t> & pending = _nodes[i].rx;
+        while (!pending.empty() && (pending.front().time <= _now)) {
+            rx += pending.front().bytes;
+            pending.erase(pending.begin());
+        }
+        tick_t tick = { _now + TICK, rx.size() };
+        _write(_nodes[i].in, &tick, sizeof(tick));
+        _write(_nodes[i].in, rx.data(), rx.size());
+    }
+
+    for (unsigned char i = 0; i < NODES; i++) {
+        reply_t reply;
+        TEST_ASSERT_TRUE(_read(_nodes[i].out, &reply, sizeof(reply)));
+        std::string sent(reply.length, '\0');
+        if (reply.length) TEST_ASSERT_TRUE(_read(_nodes[i].out, &sent[0], reply.length));
+        if (sent.empty()) continue;
+
+        _transmit(i, reply.start, reply.end);
+        _wireBytes += sent.size();
+        _masterHear(reply.end, sent);
+        for (unsigned char j = 0; j < NODES; j++) {
+            if (j != i) _nodes[j].rx.push_back((delivery_t) { reply.end, sent });
+        }
+    }
+
+    _now += TICK;
+}
+
+/**
+ * The master puts a frame on the wire once it is free, returns when its last byte is out
+ */
+unsigned long _send(const char * frame) {
+    std::string bytes(frame);
+    bytes += "~\n";
+    unsigned long start = _now;
+    for (const transmission_t & t : _transmissions) {
+        if (t.end > start) start = t.end;
+    }
+    unsigned long end = start + _wireTime(bytes.size());
+    _transmit(MASTER, start, end);
+    _wireBytes += bytes.size();
+    for (unsigned char i = 0; i < NODES; i++) _nodes[i].rx.push_back((delivery_t) { end, bytes });
+    return end;
+}
+
+/**
+ * Runs the bus until the node sent a frame containing text, returns when
+ * it was heard or 0 after ms
+ */
+unsigned long _wait(unsigned char node, const char * text, unsigned long ms) {
+    unsigned long deadline = _now + ms * 1000;
+    size_t from = _heard.size();
+    while (_now < deadline) {
+        _tick();
+        for (size_t i = from; i < _heard.size(); i++) {
+            if ((_heard[i].node == node) && (_heard[i].frame.find(text) != std::string::npos)) return _heard[i].time;
+        }
+    }
+    return 0;
+}
+
+void _idle(unsigned long ms) {
+    for (unsigned long i = 0; i < ms * 1000 / TICK; i++) _tick();
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+/**
+ * The master addresses every node in turn and waits for the relay report,
+ * raised by the event chain a few passes after the command
+ */
+void test_polled_commands() {
+    unsigned long latency[NODES] = { 0 };
+    unsigned long worst[NODES] = { 0 };
+    unsigned long start = _now;
+    unsigned long collisions = _collisions;
+    unsigned long bytes = _wireBytes;
+
+    for (unsigned char round = 0; round < ROUNDS; round++) {
+        unsigned char relay = round % NODE_RELAYS;
+        unsigned char status = (round / NODE_RELAYS + 1) % 2;
+        for (unsigned char node = 0; node < NODES; node++) {
+            char frame[24];
+            char report[24];
+            snprintf(frame, sizeof(frame), "%c2relay/%u %u", UART_BUS_ADDRESS_BASE + node, relay, status);
+            snprintf(report, sizeof(report), "2relay/%u %u~", relay, status);
+            unsigned long sent = _send(frame);
+            unsigned long heard = _wait(node, report, 100);
+            TEST_ASSERT_NOT_EQUAL_MESSAGE(0, heard, report);
+
+            // Out within the turn the command gave the node
+            unsigned long elapsed = heard - sent;
+            TEST_ASSERT_LESS_OR_EQUAL(UART_BUS_SLOT_TIME * 1000UL + TICK, elapsed);
+            latency[node] += elapsed;
+            if (elapsed > worst[node]) worst[node] = elapsed;
+        }
+    }
+    TEST_ASSERT_EQUAL(collisions, _collisions);
+
+    double seconds = (_now - start) / 1e6;
+    char message[96];
+    snprintf(message, sizeof(message), "polled: %u nodes, %.0f commands/s, %.0f%% of the wire busy",
+        NODES, ROUNDS * NODES / seconds, 100.0 * _wireTime(_wireBytes - bytes) / (_now - start));
+    TEST_MESSAGE(message);
+    for (unsigned char node = 0; node < NODES; node++) {
+        snprintf(message, sizeof(message), "node %u: %.2f ms average, %.2f ms worst", node, latency[node] / 1000.0 / ROUNDS, worst[node] / 1000.0);
+        TEST_MESSAGE(message);
+    }
+}
+
+/**
+ * Everybody answers a broadcast, each node in its own slot
+ */
+void test_broadcast_slots() {
+    _idle(50);
+    unsigned long collisions = _collisions;
+    unsigned long sent = _send("*3b");
+
+    for (unsigned char node = 0; node < NODES; node++) {
+        unsigned long heard = _wait(node, "4b", (NODES + 1) * UART_BUS_SLOT_TIME);
+        TEST_ASSERT_NOT_EQUAL(0, heard);
+        TEST_ASSERT_GREATER_OR_EQUAL(sent + node * UART_BUS_SLOT_TIME * 1000UL, heard);
+        TEST_ASSERT_LESS_OR_EQUAL(sent + (node + 1) * UART_BUS_SLOT_TIME * 1000UL + TICK, heard);
+    }
+    TEST_ASSERT_EQUAL(collisions, _collisions);
+}
+
+/**
+ * Replies built by the event chain after a broadcast still keep to the slots
+ */
+void test_broadcast_command() {
+    _idle(50);
+    unsigned long collisions = _collisions;
+    unsigned long sent = _send("*2relay/7 1");
+
+    for (unsigned char node = 0; node < NODES; node++) {
+        unsigned long heard = _wait(node, "2relay/7 1~", (NODES + 1) * UART_BUS_SLOT_TIME);
+        TEST_ASSERT_NOT_EQUAL(0, heard);
+        TEST_ASSERT_LESS_OR_EQUAL(sent + (node + 1) * UART_BUS_SLOT_TIME * 1000UL + TICK, heard);
+    }
+    _idle(50);
+    TEST_ASSERT_EQUAL(collisions, _collisions);
+}
+
+/**
+ * The configuration export of NODE_RELAYS relays is longer than a turn,
+ * it is refused instead of running into the next slots
+ */
+void test_long_export_refused() {
+    _idle(50);
+    unsigned long collisions = _collisions;
+    unsigned long sent = _send("*6");
+
+    for (unsigned char node = 0; node < NODES; node++) {
+        unsigned long heard = _wait(node, "6!~", (NODES + 1) * UART_BUS_SLOT_TIME);
+        TEST_ASSERT_NOT_EQUAL(0, heard);
+        TEST_ASSERT_LESS_OR_EQUAL(sent + (node + 1) * UART_BUS_SLOT_TIME * 1000UL + TICK, heard);
+    }
+    _idle(50);
+    TEST_ASSERT_EQUAL(collisions, _collisions);
+}
+
+int main() {
+    fflush(stdout);
+    for (unsigned char i = 0; i < NODES; i++) {
+        int in[2], out[2];
+        if ((pipe(in) != 0) || (pipe(out) != 0)) return 1;
+        pid_t pid = fork();
+        if (pid == 0) _node(i, in[0], out[1]);
+        close(in[0]);
+        close(out[1]);
+        _nodes[i].pid = pid;
+        _nodes[i].in = in[1];
+        _nodes[i].out = out[0];
+    }
+    _now = 100000;
+    _idle(10);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_polled_commands);
+    RUN_TEST(test_broadcast_slots);
+    RUN_TEST(test_broadcast_command);
+    RUN_TEST(test_long_export_refused);
+    int result = UNITY_END();
+
+    for (unsigned char i = 0; i < NODES; i++) {
+        kill(_nodes[i].pid, SIGTERM);
+        waitpid(_nodes[i].pid, NULL, 0);
+    }
+    return result;
+}
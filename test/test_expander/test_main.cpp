@@ -0,0 +1,315 @@
+/*
+
+EXPANDER TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+RELAY_PROVIDER_MCP23017 against fake MCP23017 on a fake TWI peripheral
+(pio test -e native_expander -v). A write to TWCR with TWINT set starts the
+next bus action, the test carries it out between loop passes like the
+hardware would and raises TWI_vect when it is done. The expanders take a
+register address and auto-increment from there (IOCON.BANK = 0).
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "expander.h"
+
+#define RELAYS                      16
+#define INVERSE                     5
+#define REGISTERS                   0x16
+
+// Relay id is on output 2 * id, both ports of both expanders have some
+#define OUTPUT_OF(id)               (2 * (id))
+
+// Status codes the TWI leaves in TWSR
+#define TWI_START                   0x08
+#define TWI_REP_START               0x10
+#define TWI_MT_SLA_ACK              0x18
+#define TWI_MT_SLA_NACK             0x20
+#define TWI_MT_DATA_ACK             0x28
+
+extern "C" void TWI_vect();
+
+typedef struct {
+    bool present;
+    unsigned char registers[REGISTERS];
+    unsigned long writes[REGISTERS];            // Times each register was written
+    unsigned long order[REGISTERS];             // Bus byte count at the last write
+} mcp23017_t;
+
+mcp23017_t _expanders[EXPANDER_COUNT];
+unsigned char _pending = 0;                     // TWCR value that started the next action
+bool _started = false;
+int _device = -1;                               // Addressed expander, -1 before SLA+W
+int _pointer = -1;                              // Register pointer, -1 before the first data byte
+unsigned long _bytes = 0;
+unsigned long _transactions = 0;
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// TWI and expanders
+// -----------------------------------------------------------------------------
+
+void _expanderReset(mcp23017_t & expander) {
+    memset(&expander, 0, sizeof(expander));
+    expander.present = true;
+    expander.registers[EXPANDER_IODIRA] = 0xFF;
+    expander.registers[EXPANDER_IODIRA + 1] = 0xFF;
+}
+
+/**
+ * STOP is out at once, _expanderStop spins on TWSTO
+ */
+void _twiControl(uint8_t value) {
+    if (value & _BV(TWSTO)) {
+        if (_started && (_device >= 0)) _transactions++;
+        _started = false;
+        _device = -1;
+        _pointer = -1;
+        TWCR.set(value & ~(_BV(TWSTO) | _BV(TWINT)));
+        return;
+    }
+    if (value & _BV(TWINT)) {
+        _pending = value;
+        TWCR.set(value & ~_BV(TWINT));
+    }
+}
+
+void _twiByte(unsigned char data) {
+    _bytes++;
+    if (_device < 0) {
+        unsigned char address = data >> 1;
+        int device = address - EXPANDER_ADDRESS;
+        if ((data & 1) || (device < 0) || (device >= EXPANDER_COUNT) || !_expanders[device].present) {
+            TWSR.set(TWI_MT_SLA_NACK);
+            return;
+        }
+        _device = device;
+        TWSR.set(TWI_MT_SLA_ACK);
+        return;
+    }
+
+    mcp23017_t & expander = _expanders[_device];
+    if (_pointer < 0) {
+        _pointer = data;
+    } else if (_pointer < REGISTERS) {
+        expander.registers[_pointer] = data;
+        expander.writes[_pointer]++;
+        expander.order[_pointer] = _bytes;
+        _pointer++;
+    }
+    TWSR.set(TWI_MT_DATA_ACK);
+}
+
+/**
+ * Carries out every bus action the firmware starts until it goes quiet
+ */
+void _twiRun() {
+    while (_pending) {
+        unsigned char control = _pending;
+        _pending = 0;
+        if (control & _BV(TWSTA)) {
+            TWSR.set(_started ? TWI_REP_START : TWI_START);
+            _started = true;
+            _device = -1;
+            _pointer = -1;
+        } else {
+            _twiByte(TWDR);
+        }
+        TWCR.set(TWCR | _BV(TWINT));
+        if (control & _BV(TWIE)) TWI_vect();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Like hostRun, the TWI gets its turn after every pass
+void _run(unsigned long ms) {
+    unsigned long end = hostMicros + ms * 1000;
+    while (hostMicros < end) {
+        loop();
+        _twiRun();
+        hostMicros += 1000;
+        Serial.tx.clear();
+        Serial2.tx.clear();
+    }
+}
+
+void _exchange(const char * frame) {
+    hostSend(frame);
+    _run(10);
+    hostReceive();
+}
+
+bool _output(unsigned char output) {
+    const mcp23017_t & expander = _expanders[output >> 4];
+    return expander.registers[EXPANDER_OLATA + ((output >> 3) & 1)] & (1 << (output & 7));
+}
+
+/**
+ * Every output matches the relay on it, inverse taken into account,
+ * and the outputs without a relay are LOW
+ */
+void _assertOutputs() {
+    char message[48];
+    for (unsigned char output = 0; output < 16 * EXPANDER_COUNT; output++) {
+        bool expected = false;
+        if ((output % 2 == 0) && (output / 2 < RELAYS)) {
+            unsigned char id = output / 2;
+            expected = relayStatus(id) != (id == INVERSE);
+        }
+        snprintf(message, sizeof(message), "output %u", output);
+        TEST_ASSERT_EQUAL_MESSAGE(expected, _output(output), message);
+    }
+}
+
+void _clearWrites() {
+    for (unsigned char i = 0; i < EXPANDER_COUNT; i++) {
+        memset(_expanders[i].writes, 0, sizeof(_expanders[i].writes));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+/**
+ * Latches first, so the outputs never drive a stale value, then directions
+ */
+void test_boot_configures_expanders() {
+    for (unsigned char i = 0; i < EXPANDER_COUNT; i++) {
+        const mcp23017_t & expander = _expanders[i];
+        TEST_ASSERT_EQUAL_HEX8(0x00, expander.registers[EXPANDER_IODIRA]);
+        TEST_ASSERT_EQUAL_HEX8(0x00, expander.registers[EXPANDER_IODIRA + 1]);
+        TEST_ASSERT_LESS_THAN(expander.order[EXPANDER_IODIRA], expander.order[EXPANDER_OLATA]);
+        TEST_ASSERT_LESS_THAN(expander.order[EXPANDER_IODIRA], expander.order[EXPANDER_OLATA + 1]);
+    }
+    for (unsigned char id = 0; id < RELAYS; id++) TEST_ASSERT_FALSE(relayStatus(id));
+    TEST_ASSERT_TRUE(_output(OUTPUT_OF(INVERSE)));
+    _assertOutputs();
+    TEST_ASSERT_FALSE(expanderBusy());
+    TEST_ASSERT_EQUAL(0, expanderErrors());
+}
+
+void test_each_relay_drives_its_output() {
+    char frame[24];
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        snprintf(frame, sizeof(frame), "2relay/%u 1", id);
+        _exchange(frame);
+        TEST_ASSERT_TRUE(relayStatus(id));
+        _assertOutputs();
+    }
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        snprintf(frame, sizeof(frame), "2relay/%u 0", id);
+        _exchange(frame);
+        TEST_ASSERT_FALSE(relayStatus(id));
+        _assertOutputs();
+    }
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+/**
+ * Relays switched in the same pass cost one transaction per expander,
+ * both latches in it and each written once
+ */
+void test_one_transaction_per_expander() {
+    unsigned long transactions = _transactions;
+    _clearWrites();
+    _exchange("2relay/expr 0-15:on");
+    for (unsigned char id = 0; id < RELAYS; id++) TEST_ASSERT_TRUE(relayStatus(id));
+    _assertOutputs();
+
+    TEST_ASSERT_EQUAL(transactions + EXPANDER_COUNT, _transactions);
+    for (unsigned char i = 0; i < EXPANDER_COUNT; i++) {
+        TEST_ASSERT_EQUAL(1, _expanders[i].writes[EXPANDER_OLATA]);
+        TEST_ASSERT_EQUAL(1, _expanders[i].writes[EXPANDER_OLATA + 1]);
+        TEST_ASSERT_EQUAL(0, _expanders[i].writes[EXPANDER_IODIRA]);
+    }
+
+    // Nothing changed, nothing sent
+    transactions = _transactions;
+    _run(100);
+    TEST_ASSERT_EQUAL(transactions, _transactions);
+
+    _exchange("2relay/expr 0-15:off");
+    _assertOutputs();
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+/**
+ * A change made while a transfer is still running goes out right after it
+ */
+void test_change_while_busy() {
+    hostSend("2relay/0 1");
+    while (!relayStatus(0)) hostRun(1);
+    TEST_ASSERT_TRUE(expanderBusy());
+
+    hostSend("2relay/1 1");
+    while (!relayStatus(1)) hostRun(1);
+    TEST_ASSERT_TRUE(expanderBusy());
+    TEST_ASSERT_FALSE(_output(OUTPUT_OF(0)));
+
+    _run(10);
+    TEST_ASSERT_FALSE(expanderBusy());
+    _assertOutputs();
+
+    _exchange("2relay/0 0");
+    _exchange("2relay/1 0");
+    _assertOutputs();
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+/**
+ * An expander that does not answer keeps its registers pending, they go
+ * out once it is back and the other expanders are not held up
+ */
+void test_missing_expander_is_retried() {
+    _expanders[1].present = false;
+    unsigned int errors = expanderErrors();
+    _exchange("2relay/15 1");
+    _exchange("2relay/0 1");
+    TEST_ASSERT_TRUE(relayStatus(15) && relayStatus(0));
+    TEST_ASSERT_GREATER_THAN(errors, expanderErrors());
+    TEST_ASSERT_FALSE(_output(OUTPUT_OF(15)));
+    TEST_ASSERT_TRUE(_output(OUTPUT_OF(0)));
+
+    _expanders[1].present = true;
+    errors = expanderErrors();
+    _run(10);
+    TEST_ASSERT_EQUAL(errors, expanderErrors());
+    _assertOutputs();
+
+    _exchange("2relay/expr 0:off,15:off");
+    TEST_ASSERT_FALSE(relayStatus(15) || relayStatus(0));
+    _assertOutputs();
+}
+
+int main() {
+    for (unsigned char i = 0; i < EXPANDER_COUNT; i++) _expanderReset(_expanders[i]);
+    TWCR.onWrite = _twiControl;
+
+    setSetting(K_NO_OF_RELAYS, RELAYS);
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, OUTPUT_OF(id));
+        setSetting(K_RELAY_TYPE, id, id == INVERSE ? RELAY_TYPE_INVERSE : RELAY_TYPE_NORMAL);
+    }
+    setup();
+    _twiRun();
+    _run(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_boot_configures_expanders);
+    RUN_TEST(test_each_relay_drives_its_output);
+    RUN_TEST(test_one_transaction_per_expander);
+    RUN_TEST(test_change_while_busy);
+    RUN_TEST(test_missing_expander_is_retried);
+    return UNITY_END();
+}
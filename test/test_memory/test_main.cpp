@@ -0,0 +1,225 @@
+/*
+
+MEMORY BUDGET TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Allocation counters per task (MEMORY_ALLOC_TRACKING, malloc/free/realloc
+wrapped by the linker) checked against a budget for a given workload.
+The stub String is heap backed like the core one, so every String the
+firmware builds on the way is counted.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "uart.h"
+#include "memory.h"
+
+#define RELAYS                      8
+
+void _eventLoop();
+void _schedulerLoop();
+
+typedef struct {
+    void (*owner)();
+    const char * name;
+    unsigned int allocs;            // At most this many for the workload
+} budget_t;
+
+typedef struct {
+    unsigned int allocs;
+    unsigned int frees;
+} counts_t;
+
+typedef struct {
+    const char * frame;
+    bool settings;                  // Reads or writes the settings dictionary, whose API takes Strings
+} uart_path_t;
+
+void setUp() {}
+void tearDown() {}
+
+counts_t _counts(void (*owner)()) {
+    for (unsigned char i = 0; i < memoryOwners(); i++) {
+        const memory_owner_t * entry = memoryOwner(i);
+        if (entry->owner == owner) return (counts_t) { entry->allocs, entry->frees };
+    }
+    return (counts_t) { 0, 0 };
+}
+
+/**
+ * Runs the workload and fails if a budgeted owner goes over its budget, if
+ * an owner without a budget allocates at all or if anything is kept
+ */
+void _checkBudgets(void (*workload)(), const budget_t * budgets, unsigned char count) {
+    memory_owner_t before[MEMORY_OWNERS_MAX];
+    unsigned char owners = memoryOwners();
+    for (unsigned char i = 0; i < owners; i++) before[i] = *memoryOwner(i);
+
+    workload();
+
+    char message[96];
+    for (unsigned char i = 0; i < memoryOwners(); i++) {
+        const memory_owner_t * entry = memoryOwner(i);
+        unsigned int allocs = entry->allocs - (i < owners ? before[i].allocs : 0);
+        unsigned int frees = entry->frees - (i < owners ? before[i].frees : 0);
+
+        const budget_t * budget = NULL;
+        for (unsigned char j = 0; j < count; j++) {
+            if (budgets[j].owner == entry->owner) budget = &budgets[j];
+        }
+
+        snprintf(message, sizeof(message), "%s: %u allocs, %u frees",
+            budget ? budget->name : "task without a budget", allocs, frees);
+        TEST_MESSAGE(message);
+        TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(budget ? budget->allocs : 0, allocs, message);
+        TEST_ASSERT_EQUAL_MESSAGE(allocs, frees, message);
+        TEST_ASSERT_EQUAL_MESSAGE(0, entry->failed, message);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Workloads
+// -----------------------------------------------------------------------------
+
+/**
+ * What the bridge does most: switching relays and reading their status
+ */
+void _relayTraffic() {
+    char frame[24];
+    for (unsigned char round = 0; round < 4; round++) {
+        for (unsigned char id = 0; id < RELAYS; id++) {
+            snprintf(frame, sizeof(frame), "2relay/%u %u", id, (round + 1) % 2);
+            hostExchange(frame);
+        }
+        hostExchange("2relay/0 query");
+        hostRun(1000 * RELAY_FLOOD_WINDOW);
+    }
+}
+
+/**
+ * Every route the bridge subscribes to, the wildcards are parsed in place
+ */
+void _routedTraffic() {
+    for (unsigned char round = 0; round < 4; round++) {
+        hostExchange("2relay/1/pulse 200");
+        TEST_ASSERT_TRUE(relayStatus(1));
+        hostExchange("2relay/9/pulse 200");
+        hostExchange("2relay/2/pulse soon");
+        TEST_ASSERT_FALSE(relayStatus(2));
+
+        hostExchange("2group/0 on");
+        TEST_ASSERT_TRUE(relayStatus(4) && relayStatus(7));
+        hostExchange("2group/0 toggle");
+        TEST_ASSERT_FALSE(relayStatus(4) || relayStatus(7));
+        hostExchange("2group/99 on");
+        hostExchange("2unknown/3 1");
+
+        hostRun(1000 * RELAY_FLOOD_WINDOW);
+        TEST_ASSERT_FALSE(relayStatus(1));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_relay_traffic_budget() {
+    static const budget_t budgets[] = {
+        { _uartmqttLoop, "uart", 0 },
+        { _eventLoop, "event", 0 },
+        { _relayLoop, "relay", 0 },
+        { _schedulerLoop, "scheduler", 0 },
+        { NULL, "outside tasks", 0 },
+    };
+    _checkBudgets(_relayTraffic, budgets, sizeof(budgets) / sizeof(budgets[0]));
+}
+
+void test_routed_topics_do_not_allocate() {
+
+    // Group 0 is relays 4 to 7
+    hostExchange("440F0000000 F0000000");
+
+    static const budget_t budgets[] = {
+        { _uartmqttLoop, "uart", 0 },
+        { _eventLoop, "event", 0 },
+        { _relayLoop, "relay", 0 },
+        { _schedulerLoop, "scheduler", 0 },
+        { NULL, "outside tasks", 0 },
+    };
+    _checkBudgets(_routedTraffic, budgets, sizeof(budgets) / sizeof(budgets[0]));
+}
+
+/**
+ * One frame per path through the bridge, inbound and the replies they raise
+ * Only the frames backed by the settings dictionary may use the heap, and
+ * they must give it all back
+ */
+void test_uart_paths_do_not_allocate() {
+    static const uart_path_t paths[] = {
+        { "2relay/0 1", false },
+        { "2relay/0 query", false },
+        { "2relay/0 0", false },
+        { "2relay/expr 0-3:on,5:toggle", false },
+        { "2relay/expr 0-3:off,5:toggle", false },
+        { "2relay/1/pulse 50", false },
+        { "2group/0 toggle", false },
+        { "2group/0 off", false },
+        { "2relay/99 1", false },
+        { "2relay/0", false },
+        { "z", false },
+        { "31", false },
+        { "32", false },
+        { "38", false },
+        { "3900", false },
+        { "3a", false },
+        { "3b", false },
+        { "3c", false },
+        { "#002relay/2 1", false },
+        { "#012relay/2 0", false },
+        { "#052relay/2 1", false },
+        { "411", false },
+        { "412", false },
+        { "451560000000", false },
+        { "470:0", false },
+        { "50", false },
+        { "340", true },
+        { "4410F000000 0F000000 night", true },
+        { "4601003c0001", true },
+        { "4601", true },
+        { "6", true },
+        { "6{\"relays\":[{\"pin\":22,\"type\":0,\"boot\":0}]}", true },
+    };
+
+    char message[96];
+    for (unsigned char i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        counts_t before = _counts(_uartmqttLoop);
+        hostExchange(paths[i].frame, 50);
+        counts_t after = _counts(_uartmqttLoop);
+
+        unsigned int allocs = after.allocs - before.allocs;
+        snprintf(message, sizeof(message), "%s: %u allocs, %u frees", paths[i].frame, allocs, after.frees - before.frees);
+        if (!paths[i].settings) TEST_ASSERT_EQUAL_MESSAGE(0, allocs, message);
+        TEST_ASSERT_EQUAL_MESSAGE(allocs, after.frees - before.frees, message);
+    }
+    hostRun(1000 * RELAY_FLOOD_WINDOW);
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, RELAYS);
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(1000);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_relay_traffic_budget);
+    RUN_TEST(test_routed_topics_do_not_allocate);
+    RUN_TEST(test_uart_paths_do_not_allocate);
+    return UNITY_END();
+}
@@ -0,0 +1,144 @@
+/*
+
+SCHEDULER TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+A week of virtual time, one loop pass per second, with the events set
+and deleted through the bridge like the ESP does
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "scheduler.h"
+
+#define SUNDAY                      1559433600UL    // 2019-06-02 00:00, a Sunday
+#define RELAYS                      4
+
+typedef struct {
+    unsigned int minute;
+    unsigned char relay;
+    bool status;
+} change_t;
+
+change_t _changes[32];
+unsigned char _changeCount = 0;
+
+void setUp() {}
+void tearDown() {}
+
+/**
+ * Runs for the given seconds from start (unix time), recording every relay change
+ */
+void _simulate(unsigned long start, unsigned long seconds) {
+    bool last[RELAYS];
+    for (unsigned char id = 0; id < RELAYS; id++) last[id] = relayStatus(id);
+
+    for (unsigned long s = 0; s < seconds; s++) {
+        hostRun(1000, 1000000);
+        for (unsigned char id = 0; id < RELAYS; id++) {
+            if (relayStatus(id) == last[id]) continue;
+            last[id] = relayStatus(id);
+            if (_changeCount == sizeof(_changes) / sizeof(_changes[0])) continue;
+            unsigned long now = start + s + 1;
+            _changes[_changeCount++] = (change_t) {
+                (unsigned int) (((now + 7 * 86400UL - SUNDAY) / 60) % SCHEDULER_MINUTES_WEEK), id, last[id]
+            };
+        }
+    }
+}
+
+void _expect(unsigned char index, unsigned int minute, unsigned char relay, bool status) {
+    char message[48];
+    snprintf(message, sizeof(message), "change %d", index);
+    TEST_ASSERT_TRUE_MESSAGE(index < _changeCount, message);
+    TEST_ASSERT_EQUAL_MESSAGE(minute, _changes[index].minute, message);
+    TEST_ASSERT_EQUAL_MESSAGE(relay, _changes[index].relay, message);
+    TEST_ASSERT_EQUAL_MESSAGE(status, _changes[index].status, message);
+}
+
+void test_week() {
+
+    // Index, minute of the week, relay, action
+    hostExchange("4601" "0000" "00" "00");     // Sunday 00:00 relay 0 OFF, packs to 0
+    hostExchange("4602" "275F" "00" "01");     // Saturday 23:59 relay 0 ON
+    hostExchange("4603" "0762" "01" "01");     // Monday 07:30 relay 1 ON
+    hostExchange("4604" "0762" "02" "01");     // Same minute, relay 2 ON
+    hostExchange("4605" "09D8" "01" "00");     // Monday 18:00 relay 1 OFF, deleted below
+    hostExchange("4606" "13B0" "03" "02");     // Wednesday 12:00 relay 3 toggle
+    hostExchange("4607" "1EF0" "03" "02");     // Friday 12:00 relay 3 toggle
+    hostExchange("4605");
+
+    TEST_ASSERT_TRUE(hasSetting(K_SCHEDULE, 1));
+    TEST_ASSERT_FALSE(hasSetting(K_SCHEDULE, 5));
+
+    // From Saturday 23:58 to a few minutes into the next week
+    unsigned long start = SUNDAY - 120;
+    char frame[24];
+    snprintf(frame, sizeof(frame), "45%lu", start);
+    hostExchange(frame);
+    _simulate(start, 7 * 86400UL + 300);
+
+    TEST_ASSERT_EQUAL(8, _changeCount);
+    _expect(0, 10079, 0, true);
+    _expect(1, 0, 0, false);
+    _expect(2, 1890, 1, true);
+    _expect(3, 1890, 2, true);
+    _expect(4, 5040, 3, true);
+    _expect(5, 7920, 3, false);
+    _expect(6, 10079, 0, true);
+    _expect(7, 0, 0, false);
+
+    // The deleted event never switched relay 1 back
+    TEST_ASSERT_TRUE(relayStatus(1));
+}
+
+void test_time_jump_skips_missed_events() {
+    unsigned char count = _changeCount;
+
+    // Straight to Saturday noon, nothing in between fires
+    char frame[24];
+    unsigned long start = SUNDAY + 6 * 86400UL + 12 * 3600UL;
+    snprintf(frame, sizeof(frame), "45%lu", start);
+    hostExchange(frame);
+    _simulate(start, 600);
+    TEST_ASSERT_EQUAL(count, _changeCount);
+}
+
+/**
+ * Out of range events are refused and leave the stored one alone
+ */
+void test_out_of_range_refused() {
+    unsigned long writes = hostSettingsWrites;
+    TEST_ASSERT_EQUAL_STRING("4608!~\n", hostExchange("4608" "2760" "00" "01").c_str());    // Minute 10080
+    TEST_ASSERT_EQUAL_STRING("4601!~\n", hostExchange("4601" "0000" "00" "03").c_str());    // Action 3
+    TEST_ASSERT_EQUAL_STRING("4601!~\n", hostExchange("4601" "0000" "00" "0001").c_str());  // Too long
+    TEST_ASSERT_EQUAL_STRING("46FF!~\n", hostExchange("46FF" "0000" "00" "00").c_str());    // Past SCHEDULER_MAX
+    TEST_ASSERT_EQUAL(writes, hostSettingsWrites);
+    TEST_ASSERT_FALSE(hasSetting(K_SCHEDULE, 8));
+    String stored = getSetting(K_SCHEDULE, 1, "");
+    TEST_ASSERT_EQUAL_STRING("00000000", stored.c_str());
+
+    // Accepted ones get no reply
+    TEST_ASSERT_EQUAL_STRING("", hostExchange("4608" "275F" "00" "02").c_str());
+    hostExchange("4608");
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, RELAYS);
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_week);
+    RUN_TEST(test_time_jump_skips_missed_events);
+    RUN_TEST(test_out_of_range_refused);
+    return UNITY_END();
+}
@@ -0,0 +1,160 @@
+/*
+
+SHIFT REGISTER TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+RELAY_PROVIDER_SHIFT against a simulated chain of 74HC595 (pio test -e native_shift -v)
+SPI bytes are clocked in MSB first one bit at a time, Q7' of every register
+feeds DS of the next one, and the outputs only follow on the latch rising edge.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include <SPI.h>
+#include "settings.h"
+#include "relay.h"
+
+#define REGISTERS                   RELAY_BYTES
+#define RELAYS                      16
+#define INVERSE                     5
+
+// Relay id is on output 2 * id, so every register in the chain has some
+#define OUTPUT_OF(id)               (2 * (id))
+
+unsigned char _shift[REGISTERS];
+unsigned char _storage[REGISTERS];
+bool _latch = true;
+unsigned long _latches = 0;
+unsigned long _clocked = 0;                     // Bytes since the last latch
+unsigned long _partial = 0;                     // Latches after less than the whole chain
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// Chain
+// -----------------------------------------------------------------------------
+
+uint8_t _chainTransfer(uint8_t data) {
+    for (char bit = 7; bit >= 0; bit--) {
+        unsigned char in = (data >> bit) & 1;
+        for (unsigned char i = 0; i < REGISTERS; i++) {
+            unsigned char out = _shift[i] >> 7;
+            _shift[i] = (_shift[i] << 1) | in;
+            in = out;
+        }
+    }
+    _clocked++;
+    return 0;
+}
+
+void _chainPin(uint8_t pin, uint8_t value) {
+    if (pin != RELAY_SHIFT_LATCH_PIN) return;
+    if (!_latch && value) {
+        memcpy(_storage, _shift, sizeof(_storage));
+        _latches++;
+        if (_clocked != REGISTERS) _partial++;
+        _clocked = 0;
+    }
+    _latch = value;
+}
+
+bool _output(unsigned char output) {
+    return _storage[output >> 3] & (1 << (output & 7));
+}
+
+/**
+ * Every output matches the relay on it, inverse taken into account,
+ * and the outputs without a relay are LOW
+ */
+void _assertOutputs() {
+    char message[48];
+    for (unsigned char output = 0; output < 8 * REGISTERS; output++) {
+        bool expected = false;
+        if ((output % 2 == 0) && (output / 2 < RELAYS)) {
+            unsigned char id = output / 2;
+            expected = relayStatus(id) != (id == INVERSE);
+        }
+        snprintf(message, sizeof(message), "output %u", output);
+        TEST_ASSERT_EQUAL_MESSAGE(expected, _output(output), message);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_boot_outputs_off() {
+    TEST_ASSERT_GREATER_OR_EQUAL(1, _latches);
+    TEST_ASSERT_EQUAL(0, _partial);
+    for (unsigned char id = 0; id < RELAYS; id++) TEST_ASSERT_FALSE(relayStatus(id));
+    TEST_ASSERT_TRUE(_output(OUTPUT_OF(INVERSE)));
+    _assertOutputs();
+}
+
+void test_each_relay_drives_its_output() {
+    char frame[24];
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        snprintf(frame, sizeof(frame), "2relay/%u 1", id);
+        hostExchange(frame);
+        TEST_ASSERT_TRUE(relayStatus(id));
+        _assertOutputs();
+    }
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        snprintf(frame, sizeof(frame), "2relay/%u 0", id);
+        hostExchange(frame);
+        TEST_ASSERT_FALSE(relayStatus(id));
+        _assertOutputs();
+    }
+    TEST_ASSERT_EQUAL(0, _partial);
+    hostRun(1000 * RELAY_FLOOD_WINDOW);
+}
+
+/**
+ * Relays switched in the same pass go out together, the whole chain is
+ * clocked once and latched once
+ */
+void test_one_latch_per_pass() {
+    unsigned long latches = _latches;
+    hostExchange("2relay/expr 0-15:on");
+    for (unsigned char id = 0; id < RELAYS; id++) TEST_ASSERT_TRUE(relayStatus(id));
+    TEST_ASSERT_EQUAL(latches + 1, _latches);
+    _assertOutputs();
+
+    latches = _latches;
+    hostExchange("2relay/expr 0-15:off");
+    TEST_ASSERT_EQUAL(latches + 1, _latches);
+    _assertOutputs();
+    TEST_ASSERT_EQUAL(0, _partial);
+    hostRun(1000 * RELAY_FLOOD_WINDOW);
+}
+
+void test_idle_chain_is_not_clocked() {
+    unsigned long latches = _latches;
+    _clocked = 0;
+    hostRun(5000);
+    TEST_ASSERT_EQUAL(latches, _latches);
+    TEST_ASSERT_EQUAL(0, _clocked);
+}
+
+int main() {
+    hostSpiTransfer = _chainTransfer;
+    hostPinWrite = _chainPin;
+
+    setSetting(K_NO_OF_RELAYS, RELAYS);
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, OUTPUT_OF(id));
+        setSetting(K_RELAY_TYPE, id, id == INVERSE ? RELAY_TYPE_INVERSE : RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_boot_outputs_off);
+    RUN_TEST(test_each_relay_drives_its_output);
+    RUN_TEST(test_one_latch_per_pass);
+    RUN_TEST(test_idle_chain_is_not_clocked);
+    return UNITY_END();
+}
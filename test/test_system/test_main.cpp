@@ -0,0 +1,201 @@
+/*
+
+SYSTEM TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+The watchdog path end to end. A first boot runs in a child process until a
+task stalls and WDT_vect fires, then the board "resets": the child hands
+back what survives a reset (the settings and the .noinit crash context) and
+the test boots the firmware for real with WDRF set in MCUSR.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "settings.h"
+#include "relay.h"
+#include "system.h"
+
+#define CRASHES_BEFORE              2
+#define WDT_TIME                    2000        // SYSTEM_WDT_TIMEOUT (ms)
+#define STALL_SP                    0x2123      // Stack pointer while stalled
+
+extern "C" void WDT_vect();
+extern system_crash_t _systemCrash;
+
+unsigned long _stallMs = 0;                     // Next run of the task blocks for this long
+int _resetPipe = -1;                            // Second timeout resets the board, state goes here
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// Stalling task
+// -----------------------------------------------------------------------------
+
+void _write(int fd, const void * data, size_t size) {
+    if (write(fd, data, size) != (ssize_t) size) _exit(1);
+}
+
+// Sends back what is left after the reset
+void _resetBoard(int out) {
+    _write(out, &_systemCrash, sizeof(_systemCrash));
+    for (const auto & setting : hostSettings) {
+        _write(out, setting.first.c_str(), setting.first.size() + 1);
+        _write(out, setting.second.c_str(), setting.second.size() + 1);
+    }
+    _exit(0);
+}
+
+/**
+ * Blocks the loop, the watchdog interrupt fires WDT_TIME into it and clears
+ * WDIE like the hardware does. Past a second timeout the board resets.
+ */
+void _stall() {
+    if (_stallMs == 0) return;
+    unsigned long ms = _stallMs;
+    _stallMs = 0;
+
+    uint16_t sp = SP;
+    SP = STALL_SP;
+    hostMicros += WDT_TIME * 1000UL;
+    WDTCSR &= ~_BV(WDIE);
+    WDT_vect();
+    SP = sp;
+
+    if ((ms >= 2 * WDT_TIME) && (_resetPipe >= 0)) _resetBoard(_resetPipe);
+    hostMicros += (ms - WDT_TIME) * 1000UL;
+}
+
+// -----------------------------------------------------------------------------
+// Reset
+// -----------------------------------------------------------------------------
+
+void _boot() {
+    setSetting(K_NO_OF_RELAYS, 1);
+    setSetting(K_RELAY_PIN, 0, 22);
+    setSetting(K_RELAY_TYPE, 0, RELAY_TYPE_NORMAL);
+    setup();
+    taskRegister(_stall, 1, TASK_PRIORITY_NORMAL);
+    hostRun(100);
+}
+
+/**
+ * First boot, stalls until the second timeout
+ */
+void _firstBoot(int out) {
+    _boot();
+    _resetPipe = out;
+    _stallMs = 2 * WDT_TIME + 100;
+    hostRun(10);
+    _exit(1);
+}
+
+/**
+ * The settings and the crash context are back where they were, the rest
+ * of the RAM is what this process starts with
+ */
+bool _reset(int in) {
+    std::string bytes;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) bytes.append(buffer, n);
+    if (bytes.size() < sizeof(_systemCrash)) return false;
+
+    memcpy(&_systemCrash, bytes.data(), sizeof(_systemCrash));
+    hostSettings.clear();
+    size_t p = sizeof(_systemCrash);
+    while (p < bytes.size()) {
+        std::string key = bytes.c_str() + p;
+        p += key.size() + 1;
+        if (p >= bytes.size()) return false;
+        std::string value = bytes.c_str() + p;
+        p += value.size() + 1;
+        hostSettings[key] = value;
+    }
+
+    MCUSR = _BV(WDRF);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_crash_counted_once() {
+    TEST_ASSERT_EQUAL(CRASHES_BEFORE + 1, systemCrashCount());
+    TEST_ASSERT_EQUAL(CRASHES_BEFORE + 1, getSetting(K_CRASH_COUNT, 0).toInt());
+    TEST_ASSERT_TRUE(systemResetReason() & _BV(WDRF));
+    TEST_ASSERT_EQUAL(0, MCUSR);
+
+    // Consumed, a later reset without a capture does not count it again
+    TEST_ASSERT_NOT_EQUAL(SYSTEM_CRASH_MAGIC, _systemCrash.magic);
+}
+
+void test_crash_context() {
+    const system_crash_t * crash = systemCrash();
+    TEST_ASSERT_NOT_NULL(crash);
+    TEST_ASSERT_EQUAL_HEX16((unsigned int) (uintptr_t) _stall, crash->callback);
+    TEST_ASSERT_UINT_WITHIN(RELAY_LOOP_INTERVAL, WDT_TIME, crash->duration);
+    TEST_ASSERT_LESS_OR_EQUAL(10, crash->last);
+    TEST_ASSERT_EQUAL_HEX16(STALL_SP, crash->sp);
+}
+
+/**
+ * Asked for, and without asking once the bridge says it is connected
+ */
+void test_crash_report() {
+    const system_crash_t * crash = systemCrash();
+    char expected[64];
+    snprintf(expected, sizeof(expected), "48%u:%u:%u:%lu:%lu:%u~\n", CRASHES_BEFORE + 1, systemResetReason(),
+        crash->callback, crash->duration, crash->last, crash->sp);
+
+    std::string reply = hostExchange("38");
+    TEST_ASSERT_EQUAL_STRING(expected, reply.c_str());
+
+    reply = hostExchange("411");
+    TEST_ASSERT_TRUE(reply.find(expected) != std::string::npos);
+}
+
+/**
+ * The loop came back before the second timeout, nothing is counted and
+ * the watchdog interrupt is armed again
+ */
+void test_recovered_stall() {
+    _stallMs = WDT_TIME + 100;
+    hostRun(20);
+    TEST_ASSERT_EQUAL(0, _stallMs);
+    TEST_ASSERT_TRUE(WDTCSR & _BV(WDIE));
+    TEST_ASSERT_EQUAL(0, _systemCrash.magic);
+    TEST_ASSERT_EQUAL(CRASHES_BEFORE + 1, systemCrashCount());
+    TEST_ASSERT_EQUAL(CRASHES_BEFORE + 1, getSetting(K_CRASH_COUNT, 0).toInt());
+}
+
+int main() {
+    setSetting(K_CRASH_COUNT, CRASHES_BEFORE);
+
+    int pipes[2];
+    if (pipe(pipes) != 0) return 1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipes[0]);
+        _firstBoot(pipes[1]);
+    }
+    close(pipes[1]);
+    bool reset = _reset(pipes[0]);
+    waitpid(pid, NULL, 0);
+    if (!reset) return 1;
+
+    _boot();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_crash_counted_once);
+    RUN_TEST(test_crash_context);
+    RUN_TEST(test_crash_report);
+    RUN_TEST(test_recovered_stall);
+    return UNITY_END();
+}
@@ -0,0 +1,349 @@
+/*
+
+UART FRAME TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+Valid and malformed frames through _receiveUART and _uartProcess,
+plus the parser throughput (pio test -e native -f test_uart -v)
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "uart.h"
+#include "event.h"
+#include "topic.h"
+
+#define BENCH_FRAMES                20000
+
+void setUp() {}
+void tearDown() {}
+
+// Link stats as "<baud>:<malformed>:<overflows>:<dropped commands>:<line errors>"
+std::string _stats() {
+    std::string reply = hostExchange("3b");
+    size_t start = reply.find("4b");
+    if (start == std::string::npos) return "";
+    return reply.substr(start + 2, reply.find('~') - start - 2);
+}
+
+void test_publish_switches_relay() {
+    std::string reply = hostExchange("2relay/0 1");
+    TEST_ASSERT_TRUE(relayStatus(0));
+    TEST_ASSERT_TRUE(reply.find("2relay/0 1~\n") != std::string::npos);
+
+    reply = hostExchange("2relay/0 off");
+    TEST_ASSERT_FALSE(relayStatus(0));
+    TEST_ASSERT_TRUE(reply.find("2relay/0 0~\n") != std::string::npos);
+}
+
+void test_frame_split_across_polls() {
+    const char * frame = "2relay/1 1~\n";
+    hostReceive();
+    while (*frame) {
+        HOST_BRIDGE.rx.push_back(*frame++);
+        hostRun(1);
+    }
+    hostRun(5);
+    TEST_ASSERT_TRUE(relayStatus(1));
+    hostExchange("2relay/1 0");
+}
+
+void test_malformed_frames_are_counted() {
+    std::string before = _stats();
+    HOST_BRIDGE.feed("2relay/0 1\n");       // No end symbol
+    HOST_BRIDGE.feed("~\n");                // Empty
+    hostRun(5);
+    TEST_ASSERT_FALSE(relayStatus(0));
+
+    unsigned long baud, malformed, overflows;
+    sscanf(before.c_str(), "%lu:%lu:%lu", &baud, &malformed, &overflows);
+    unsigned long malformed_after;
+    sscanf(_stats().c_str(), "%lu:%lu", &baud, &malformed_after);
+    TEST_ASSERT_EQUAL(malformed + 2, malformed_after);
+}
+
+unsigned long _lineErrors() {
+    unsigned long baud, malformed, overflows, dropped, errors = 0;
+    sscanf(_stats().c_str(), "%lu:%lu:%lu:%lu:%lu", &baud, &malformed, &overflows, &dropped, &errors);
+    return errors;
+}
+
+/**
+ * Framing errors flagged by the USART count like bad frames, enough of
+ * them step the negotiated speed down
+ */
+void test_line_errors_step_down() {
+    TEST_ASSERT_TRUE(hostExchange("4b1000000").find("4b1000000~\n") != std::string::npos);
+    TEST_ASSERT_EQUAL(1000000, HOST_BRIDGE.baud);
+    unsigned long errors = _lineErrors();
+
+    UCSR1A = _BV(FE1);
+    for (unsigned char i = 0; (i < UART_ERROR_THRESHOLD) && (HOST_BRIDGE.baud == 1000000); i++) hostRun(1);
+    UCSR1A = 0;
+    TEST_ASSERT_EQUAL(500000, HOST_BRIDGE.baud);
+    TEST_ASSERT_TRUE(hostReceive().find("4b500000~\n") != std::string::npos);
+
+    // Each sample counted once
+    unsigned long counted = _lineErrors() - errors;
+    TEST_ASSERT_GREATER_THAN(0, counted);
+    TEST_ASSERT_LESS_OR_EQUAL(UART_ERROR_THRESHOLD, counted);
+
+    hostExchange("4b115200");
+    TEST_ASSERT_EQUAL(UART_BAUDRATE, HOST_BRIDGE.baud);
+}
+
+/**
+ * A command that finds the event queue full is lost, but counted
+ */
+void test_dropped_commands_are_counted() {
+    unsigned long baud, malformed, overflows, dropped, dropped_after;
+    sscanf(_stats().c_str(), "%lu:%lu:%lu:%lu", &baud, &malformed, &overflows, &dropped);
+
+    while (eventPublish(EVENT_LINK_UP));
+    TEST_ASSERT_TRUE(topicDispatch("relay/0", "1"));
+    hostRun(5);
+    TEST_ASSERT_FALSE(relayStatus(0));
+
+    sscanf(_stats().c_str(), "%lu:%lu:%lu:%lu", &baud, &malformed, &overflows, &dropped_after);
+    TEST_ASSERT_EQUAL(dropped + 1, dropped_after);
+    TEST_ASSERT_EQUAL(dropped_after, relayCommandsDropped());
+}
+
+void test_long_frame_is_discarded() {
+    std::string frame = "2relay/0 1";
+    frame.append(UART_BUFFER_SIZE, ' ');
+    hostExchange(frame.c_str());
+    TEST_ASSERT_FALSE(relayStatus(0));
+
+    // The next one is parsed from a clean buffer
+    hostExchange("2relay/0 1");
+    TEST_ASSERT_TRUE(relayStatus(0));
+    hostExchange("2relay/0 0");
+}
+
+void test_bad_publish_and_opcode_ignored() {
+    TEST_ASSERT_EQUAL_STRING("", hostExchange("2relay/0").c_str());
+    TEST_ASSERT_EQUAL_STRING("", hostExchange("2 1").c_str());
+    TEST_ASSERT_EQUAL_STRING("", hostExchange("z").c_str());
+    TEST_ASSERT_EQUAL_STRING("", hostExchange("2relay/99 1").c_str());
+    TEST_ASSERT_FALSE(relayStatus(0));
+}
+
+void test_sync_follows_replayed_changes() {
+    hostExchange("411");
+    hostExchange("2relay/2 1");
+    hostExchange("2relay/3 1");
+
+    char frame[24];
+    char sync[24];
+    snprintf(frame, sizeof(frame), "47%u:%u", relayEpoch(), relaySequence() - 2);
+    snprintf(sync, sizeof(sync), "47%u:%u~\n", relayEpoch(), relaySequence());
+    std::string reply = hostExchange(frame);
+    size_t changes = reply.find("2relay/3 1~\n");
+    TEST_ASSERT_TRUE(reply.find("2relay/2 1~\n") < changes);
+    TEST_ASSERT_TRUE(changes != std::string::npos);
+    TEST_ASSERT_TRUE(reply.find(sync) > changes);
+    TEST_ASSERT_TRUE(reply.find(sync) != std::string::npos);
+
+    // Another epoch gets the bitmap, still followed by the sequence
+    reply = hostExchange("470:0");
+    TEST_ASSERT_TRUE(reply.find("2relay/all 0C~\n") < reply.find(sync));
+    TEST_ASSERT_TRUE(reply.find(sync) != std::string::npos);
+
+    hostExchange("2relay/2 0");
+    hostExchange("2relay/3 0");
+    hostExchange("412");
+}
+
+void test_scene_round_trip() {
+    hostExchange("4400F000000 0F000000 evening");
+    TEST_ASSERT_TRUE(hostExchange("340").find("4400F000000 0F000000 evening~\n") != std::string::npos);
+
+    // Nothing boots from the saved status, applying it writes nothing
+    unsigned long writes = hostSettingsWrites;
+    hostExchange("50");
+    TEST_ASSERT_TRUE(relayStatus(3));
+    TEST_ASSERT_EQUAL(writes, hostSettingsWrites);
+
+    // Redefined without a name
+    hostExchange("4400F000000 0F000000");
+    TEST_ASSERT_TRUE(hostExchange("340").find("4400F000000 0F000000~\n") != std::string::npos);
+
+    hostExchange("4400F000000 00000000");
+    hostExchange("2relay/0 0");
+    hostExchange("2relay/1 0");
+    hostExchange("2relay/2 0");
+    hostExchange("2relay/3 0");
+}
+
+void test_expression_pulse_held_by_flood() {
+    hostRun(1000 * RELAY_FLOOD_WINDOW);
+    for (unsigned char i = 0; i < RELAY_FLOOD_CHANGES - 1; i++) {
+        hostExchange(i % 2 ? "2relay/4 0" : "2relay/4 1");
+    }
+
+    // Held back to the end of the flood window, the pulse starts from there
+    hostExchange("2relay/expr 4:pulse500");
+    TEST_ASSERT_FALSE(relayStatus(4));
+    hostRun(1000 * RELAY_FLOOD_WINDOW);
+    TEST_ASSERT_TRUE(relayStatus(4));
+    hostRun(600);
+    TEST_ASSERT_FALSE(relayStatus(4));
+}
+
+/**
+ * Parser only, frames that do not reach a handler with side effects
+ */
+/**
+ * Out of range values fail the whole document, relays parsed before the
+ * error are not written either
+ */
+void test_config_import_is_all_or_nothing() {
+    unsigned long writes = hostSettingsWrites;
+    TEST_ASSERT_EQUAL_STRING("6!~\n", hostExchange("6{\"relays\":[{\"pin\":40},{\"pin\":300}]}").c_str());
+    TEST_ASSERT_EQUAL_STRING("6!~\n", hostExchange("6{\"relays\":[{\"pin\":18446744073709551656}]}").c_str());
+
+    // Split, the first piece had a whole relay
+    TEST_ASSERT_EQUAL_STRING("6+~\n", hostExchange("6{\"relays\":[{\"pin\":40,\"type\":0},").c_str());
+    TEST_ASSERT_EQUAL_STRING("6!~\n", hostExchange("6{\"pin\":41,\"boot\":256}]}").c_str());
+    TEST_ASSERT_EQUAL(writes, hostSettingsWrites);
+    TEST_ASSERT_EQUAL(22, getSetting(K_RELAY_PIN, 0, GPIO_NONE).toInt());
+
+    TEST_ASSERT_EQUAL_STRING("6+~\n", hostExchange("6{\"relays\":[{\"pin\":40,\"type\":0},").c_str());
+    TEST_ASSERT_EQUAL_STRING("6=~\n", hostExchange("6{\"pin\":255}]}").c_str());
+    TEST_ASSERT_EQUAL(40, getSetting(K_RELAY_PIN, 0, GPIO_NONE).toInt());
+    TEST_ASSERT_EQUAL(255, getSetting(K_RELAY_PIN, 1, GPIO_NONE).toInt());
+    TEST_ASSERT_EQUAL(2, getSetting(K_NO_OF_RELAYS, 0).toInt());
+
+    // Only used after a reboot, put back what the other tests booted with
+    setSetting(K_NO_OF_RELAYS, 8);
+    setSetting(K_RELAY_PIN, 0, 22);
+    setSetting(K_RELAY_PIN, 1, 23);
+    setSetting(K_RELAY_TYPE, 0, RELAY_TYPE_NORMAL);
+}
+
+void test_parser_throughput() {
+    static const char * frames[] = {
+        "2sensor/temp 21.5~\n",
+        "2relay/x 1~\n",
+        "2relay/0~\n",
+        "9unknown~\n",
+        "2relay/0 1 garbage without end\n",
+        "#002relay/0 1~\n",
+    };
+    const unsigned char count = sizeof(frames) / sizeof(frames[0]);
+
+    hostReceive();
+    double start = hostSeconds();
+    for (unsigned long i = 0; i < BENCH_FRAMES; i++) {
+        HOST_BRIDGE.feed(frames[i % count]);
+        _receiveUART();
+        _uartProcess();
+    }
+    double elapsed = hostSeconds() - start;
+    hostRun(10);
+    hostReceive();
+
+    char message[96];
+    snprintf(message, sizeof(message), "parser: %.0f frames/s, %.0f ns/frame", BENCH_FRAMES / elapsed, 1e9 * elapsed / BENCH_FRAMES);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_THAN(0, BENCH_FRAMES / elapsed);
+}
+
+/**
+ * Whole path through the loop, commands are routed and queued, the flood
+ * protection holds most of the switching back until the end
+ */
+void test_command_throughput() {
+    char frame[24];
+    hostReceive();
+    double start = hostSeconds();
+    for (unsigned long i = 0; i < BENCH_FRAMES; i++) {
+        snprintf(frame, sizeof(frame), "2relay/%lu %lu~\n", i % 8, (i / 8 + 1) % 2);
+        HOST_BRIDGE.feed(frame);
+        hostRun(2);
+        HOST_BRIDGE.tx.clear();
+    }
+    double elapsed = hostSeconds() - start;
+
+    char message[96];
+    snprintf(message, sizeof(message), "commands: %.0f frames/s, %.0f ns/frame", BENCH_FRAMES / elapsed, 1e9 * elapsed / BENCH_FRAMES);
+    TEST_MESSAGE(message);
+
+    // The last command wins once the flood window is over
+    hostRun(1000 * RELAY_FLOOD_WINDOW + 100);
+    TEST_ASSERT_FALSE(relayStatus(7));
+}
+
+/**
+ * Switching all 8 relays, one frame per relay against one expression frame
+ * Each batch runs until the bridge input is drained, rates are relays per second
+ */
+void test_expression_throughput() {
+    static const unsigned long batches = BENCH_FRAMES / 8;
+    char frame[24];
+    char message[96];
+    double rates[2];
+    unsigned long bytes[2] = { 0, 0 };
+
+    for (unsigned char expression = 0; expression < 2; expression++) {
+        hostReceive();
+        double start = hostSeconds();
+        for (unsigned long i = 0; i < batches; i++) {
+            unsigned long status = (i + 1) % 2;
+            if (expression) {
+                snprintf(frame, sizeof(frame), "2relay/expr 0-7:%lu~\n", status);
+                HOST_BRIDGE.feed(frame);
+                bytes[1] += strlen(frame);
+            } else {
+                for (unsigned char id = 0; id < 8; id++) {
+                    snprintf(frame, sizeof(frame), "2relay/%u %lu~\n", id, status);
+                    HOST_BRIDGE.feed(frame);
+                    bytes[0] += strlen(frame);
+                }
+            }
+            while (HOST_BRIDGE.available()) hostRun(1);
+            hostRun(2);
+            HOST_BRIDGE.tx.clear();
+        }
+        rates[expression] = 8 * batches / (hostSeconds() - start);
+        hostRun(1000 * RELAY_FLOOD_WINDOW + 100);
+        TEST_ASSERT_FALSE(relayStatus(0) || relayStatus(7));
+    }
+
+    snprintf(message, sizeof(message), "8 single frames: %.0f relays/s, %lu bytes per batch", rates[0], bytes[0] / batches);
+    TEST_MESSAGE(message);
+    snprintf(message, sizeof(message), "1 expression frame: %.0f relays/s, %lu bytes per batch", rates[1], bytes[1] / batches);
+    TEST_MESSAGE(message);
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, 8);
+    for (unsigned char id = 0; id < 8; id++) {
+        setSetting(K_RELAY_PIN, id, 22 + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    hostRun(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_publish_switches_relay);
+    RUN_TEST(test_frame_split_across_polls);
+    RUN_TEST(test_malformed_frames_are_counted);
+    RUN_TEST(test_line_errors_step_down);
+    RUN_TEST(test_dropped_commands_are_counted);
+    RUN_TEST(test_long_frame_is_discarded);
+    RUN_TEST(test_bad_publish_and_opcode_ignored);
+    RUN_TEST(test_sync_follows_replayed_changes);
+    RUN_TEST(test_scene_round_trip);
+    RUN_TEST(test_expression_pulse_held_by_flood);
+    RUN_TEST(test_config_import_is_all_or_nothing);
+    RUN_TEST(test_parser_throughput);
+    RUN_TEST(test_command_throughput);
+    RUN_TEST(test_expression_throughput);
+    return UNITY_END();
+}
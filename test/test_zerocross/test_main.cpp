@@ -0,0 +1,235 @@
+/*
+
+ZERO CROSS TESTS
+
+Copyright (C) 2019 by Shaeed Khan
+
+ZEROCROSS_SUPPORT against a synthetic mains signal (pio test -e native_zerocross -v)
+The detector raises the pin interrupt on every crossing, twice per mains
+period, and Timer1 fires its compare vector ZEROCROSS_OFFSET after it was
+started. Loop passes, crossings and the timer run in time order.
+native_zerocross_late runs it with an offset longer than the half period.
+
+*/
+
+#include <unity.h>
+#include <host.h>
+#include "settings.h"
+#include "relay.h"
+#include "zerocross.h"
+
+#define RELAYS                      4
+#define FIRST_PIN                   22          // 22 and 23 on one port, 24 and 25 on the next
+#define STEP                        1000        // Loop pass (us)
+
+#if ZEROCROSS_OFFSET > 0
+extern "C" void TIMER1_COMPA_vect();
+#endif
+
+unsigned long _hz = 0;                          // Mains frequency, 0 for no signal
+unsigned long _signalStart = 0;
+unsigned long _crossingCount = 0;               // Crossings since _signalStart
+unsigned long _timerStart = 0;                  // Crossing that (re)started Timer1
+unsigned long _loopAt = 0;
+
+unsigned long _switches = 0;                    // Times the relay pins changed from the interrupts
+unsigned long _switchedAt = 0;
+unsigned long _switchedAfter = 0;               // From the crossing that timed the switch
+unsigned long _loopSwitches = 0;                // Times they changed from a loop pass
+
+void setUp() {}
+void tearDown() {}
+
+// -----------------------------------------------------------------------------
+// Mains and Timer1
+// -----------------------------------------------------------------------------
+
+unsigned char _pins() {
+    unsigned char pins = 0;
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        if (digitalRead(FIRST_PIN + id)) pins |= 1 << id;
+    }
+    return pins;
+}
+
+void _mains(unsigned long hz) {
+    _hz = hz;
+    _signalStart = hostMicros;
+    _crossingCount = 0;
+}
+
+unsigned long _nextCrossing() {
+    return _signalStart + (unsigned long) ((_crossingCount + 1) * 1000000ULL / (2 * _hz));
+}
+
+bool _timerRunning() {
+    return (TCCR1B & _BV(CS11)) && (TIMSK1 & _BV(OCIE1A));
+}
+
+unsigned long _timerCompare() {
+    return _timerStart + OCR1A / 2;
+}
+
+// Pin changes made by an interrupt are recorded with their time from the crossing
+void _interrupt(void (*vector)(), unsigned long crossing) {
+    unsigned char pins = _pins();
+    vector();
+    if (_pins() != pins) {
+        _switches++;
+        _switchedAt = hostMicros;
+        _switchedAfter = hostMicros - crossing;
+    }
+}
+
+/**
+ * Runs loop passes, crossings and the compare match in time order
+ */
+void _run(unsigned long ms) {
+    unsigned long end = hostMicros + ms * 1000;
+    if (_loopAt < hostMicros) _loopAt = hostMicros;
+
+    while (hostMicros < end) {
+        unsigned long next = _loopAt;
+        if (_hz && (_nextCrossing() < next)) next = _nextCrossing();
+        #if ZEROCROSS_OFFSET > 0
+            if (_timerRunning() && (_timerCompare() < next)) next = _timerCompare();
+        #endif
+        if (next > hostMicros) hostMicros = next;
+
+        if (_hz && (_nextCrossing() == hostMicros)) {
+            _crossingCount++;
+
+            // Counting goes on from where it was unless the firmware cleared TCNT1
+            TCNT1 = 1;
+            _interrupt(hostInterrupts[digitalPinToInterrupt(ZEROCROSS_PIN)], hostMicros);
+            if (_timerRunning() && (TCNT1 == 0)) _timerStart = hostMicros;
+            continue;
+        }
+
+        #if ZEROCROSS_OFFSET > 0
+            if (_timerRunning() && (_timerCompare() == hostMicros)) {
+                _interrupt(TIMER1_COMPA_vect, _timerStart);
+                continue;
+            }
+        #endif
+
+        unsigned char pins = _pins();
+        loop();
+        if (_pins() != pins) _loopSwitches++;
+        Serial.tx.clear();
+        Serial2.tx.clear();
+        _loopAt = hostMicros + STEP;
+    }
+}
+
+void _exchange(const char * frame) {
+    hostSend(frame);
+    _run(5);
+    hostReceive();
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+void test_detector_interrupt() {
+    int interrupt = digitalPinToInterrupt(ZEROCROSS_PIN);
+    TEST_ASSERT_NOT_NULL(hostInterrupts[interrupt]);
+    TEST_ASSERT_EQUAL(RISING, hostInterruptModes[interrupt]);
+}
+
+void test_period_follows_mains() {
+    _mains(50);
+    _run(200);
+    TEST_ASSERT_EQUAL(10000, zerocrossPeriod());
+
+    _mains(60);
+    _run(200);
+    TEST_ASSERT_UINT_WITHIN(1, 8333, zerocrossPeriod());
+
+    // Signal lost
+    _mains(0);
+    _run(ZEROCROSS_TIMEOUT + 10);
+    TEST_ASSERT_EQUAL(0, zerocrossPeriod());
+}
+
+/**
+ * The relay is ON as soon as the loop switched it, the pin follows
+ * ZEROCROSS_OFFSET after the next crossing and never from the loop
+ */
+void _checkSwitching(unsigned long hz, const char * frame, unsigned char pins) {
+    _mains(hz);
+    _run(100);
+
+    unsigned long switches = _switches;
+    unsigned long loops = _loopSwitches;
+    hostSend(frame);
+    unsigned long sent = hostMicros;
+    _run(100);
+
+    TEST_ASSERT_EQUAL(pins, _pins());
+    TEST_ASSERT_EQUAL(loops, _loopSwitches);
+    TEST_ASSERT_EQUAL(switches + 1, _switches);
+    TEST_ASSERT_EQUAL(ZEROCROSS_OFFSET, _switchedAfter);
+
+    // On the first crossing after the relay loop had it
+    unsigned long half = 1000000UL / (2 * hz);
+    TEST_ASSERT_LESS_OR_EQUAL(sent + 1000UL * RELAY_LOOP_INTERVAL + half + ZEROCROSS_OFFSET + STEP, _switchedAt);
+}
+
+void test_switching_at_50hz() {
+    _checkSwitching(50, "2relay/0 1", 0x01);
+    _checkSwitching(50, "2relay/0 0", 0x00);
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+void test_switching_at_60hz() {
+    _checkSwitching(60, "2relay/1 1", 0x02);
+    _checkSwitching(60, "2relay/1 0", 0x00);
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+/**
+ * Relays changed in the same pass, on different ports, share a crossing
+ */
+void test_batch_on_one_crossing() {
+    _checkSwitching(50, "2relay/expr 0-3:on", 0x0F);
+    _checkSwitching(50, "2relay/expr 0:off,2:off", 0x0A);
+    _checkSwitching(60, "2relay/expr 0-3:toggle", 0x05);
+    _checkSwitching(60, "2relay/expr 0-3:off", 0x00);
+    _run(1000 * RELAY_FLOOD_WINDOW);
+}
+
+void test_no_signal_switches_right_away() {
+    _mains(0);
+    _run(ZEROCROSS_TIMEOUT + 10);
+
+    unsigned long loops = _loopSwitches;
+    _exchange("2relay/3 1");
+    _run(RELAY_LOOP_INTERVAL + 1);
+    TEST_ASSERT_EQUAL(0x08, _pins());
+    TEST_ASSERT_EQUAL(loops + 1, _loopSwitches);
+
+    _exchange("2relay/3 0");
+    _run(RELAY_LOOP_INTERVAL + 1);
+    TEST_ASSERT_EQUAL(0x00, _pins());
+}
+
+int main() {
+    setSetting(K_NO_OF_RELAYS, RELAYS);
+    for (unsigned char id = 0; id < RELAYS; id++) {
+        setSetting(K_RELAY_PIN, id, FIRST_PIN + id);
+        setSetting(K_RELAY_TYPE, id, RELAY_TYPE_NORMAL);
+    }
+    setup();
+    _run(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_detector_interrupt);
+    RUN_TEST(test_period_follows_mains);
+    RUN_TEST(test_switching_at_50hz);
+    RUN_TEST(test_switching_at_60hz);
+    RUN_TEST(test_batch_on_one_crossing);
+    RUN_TEST(test_no_signal_switches_right_away);
+    return UNITY_END();
+}